@@ -44,6 +44,20 @@ struct {
     u32 offset;
 } hashCache[16];
 
+struct Prefetch {
+    u32 hash;
+    u32 *data;
+    u32 offset;
+    u32 length;
+    u32 source;
+};
+constexpr u32 prefetchCapacity = 8;
+constexpr u32 prefetchBudget = 1024;
+Prefetch prefetchQueue[prefetchCapacity];
+u32 prefetchCount = 0;
+File *prefetchFile = nullptr;
+u32 prefetchOpen = 0; // hash of the file prefetchFile has open
+
 void nopUpdate(){}
 void (*onUpdate)() = nopUpdate;
 
@@ -118,6 +132,12 @@ void cleanup(){
         delete musicFile;
         musicFile = nullptr;
     }
+    if(prefetchFile){
+        delete prefetchFile;
+        prefetchFile = nullptr;
+    }
+    prefetchOpen = 0;
+    prefetchCount = 0;
     Audio::stop<0>();
     Audio::stop<1>();
     note = Audio::Note().duration(500).wave(1).loop(false);
@@ -330,7 +350,7 @@ void setFlip(int f){ flip = f; }
 void sprite(int x, int y, const uint8_t *ptr){
     if(ptr){
         auto iptr = reinterpret_cast<uintptr_t>(ptr);
-        if( iptr > 0x10000000 && iptr < 0x10008000 && (iptr & 0x3) == 0){
+        if( iptr > pine::memoryMap.heap && iptr < pine::memoryMap.heapEnd() && (iptr & 0x3) == 0){
             PD::m_colordepth = ptr[1]; // PD::setColorDepth(ptr[1]);
             PD::drawSprite(
                 x, y,
@@ -426,10 +446,13 @@ void clearHashCache(){
     }
 }
 
+void retargetPrefetch();
+
 u32 loadRes(u32 nameHash){
     char path[128];
     pathFromHash(nameHash, path, 128);
     // LOG("Loading res ", (const char*) path, "\n");
+    retargetPrefetch();
     if(!resourceFile)
         resourceFile = new File();
     if(!resourceFile->openRO(path))
@@ -439,14 +462,14 @@ u32 loadRes(u32 nameHash){
     return 1;
 }
 
-u32 readResource(u32 hash, char *ptr){
+bool seekResource(u32 hash){
     using namespace pine;
 
     if(!resourceFile || !hash)
-        return 0;
+        return false;
 
     auto& file = *resourceFile;
-    if(!file) return 0;
+    if(!file) return false;
 
     auto& cache = hashCache[hash & 0xF];
     if(cache.hash == hash){
@@ -470,7 +493,7 @@ u32 readResource(u32 hash, char *ptr){
                 // char buf[33];
                 // stringFromHash(hash, buf, 32);
                 // LOG("Missing resource ", (const char*) buf, " i=", low, " pivot=", (void*)pivot, " hash=", (void*)hash, "\n");
-                return 0;
+                return false;
             }
             if(pivot < hash){
                 low = mid + 1;
@@ -478,9 +501,16 @@ u32 readResource(u32 hash, char *ptr){
                 hi = mid - 1;
             }
         }
-        if(low > hi) return 0;
+        if(low > hi) return false;
     }
+    return true;
+}
+
+u32 readResource(u32 hash, char *ptr){
+    if(!seekResource(hash))
+        return 0;
 
+    auto& file = *resourceFile;
     auto len = file.read<u32>();
     bool created = false;
     if(!ptr){
@@ -552,18 +582,163 @@ char *readFileEx(char *path, char *ptr){
     return ptr;
 }
 
+u32 findPrefetch(u32 hash){
+    u32 i = 0;
+    while(i < prefetchCount && prefetchQueue[i].hash != hash)
+        i++;
+    return i;
+}
+
+void dropPrefetch(u32 i){
+    prefetchCount--;
+    for(; i < prefetchCount; ++i)
+        prefetchQueue[i] = prefetchQueue[i + 1];
+}
+
+bool openPrefetchFile(u32 hash, const char *path){
+    if(prefetchOpen == hash)
+        return true;
+    if(!prefetchFile)
+        prefetchFile = new File();
+    prefetchOpen = prefetchFile->openRO(path) ? hash : 0;
+    return prefetchOpen;
+}
+
+bool openPrefetch(Prefetch &job){
+    u32 length;
+    if(seekResource(job.hash)){
+        length = resourceFile->read<u32>();
+        job.source = resourceFile->tell();
+    }else{
+        char path[128];
+        pathFromHash(job.hash, path, 128);
+        auto len = strlen(path);
+        if(len >= 4 && strcmp(path + len - 4, ".res") == 0)
+            return false;
+        if(!openPrefetchFile(job.hash, path))
+            return false;
+        length = prefetchFile->size();
+        job.source = 0;
+    }
+
+    u32 size = length;
+    if(size & 3) size += 4;
+    job.data = pine::arrayCtr(size >> 2);
+    if(!job.data)
+        return false;
+    job.data[-1] |= 1 << 17; // rooted until claimed by file()
+    job.offset = 0;
+    job.length = length;
+    return true;
+}
+
+// Reads up to budget bytes of job i. Drops the job and returns false if
+// it can't be opened.
+bool serviceJob(u32 i, u32 &budget){
+    auto &job = prefetchQueue[i];
+    if(job.length == ~u32{} && !openPrefetch(job)){
+        LOG("Could not prefetch ", job.hash, "\n");
+        dropPrefetch(i);
+        return false;
+    }
+    u32 size = std::min(budget, job.length - job.offset);
+    if(!size)
+        return true;
+    File *file = resourceFile;
+    if(!job.source){
+        // another job may have taken prefetchFile since this one started
+        char path[128];
+        pathFromHash(job.hash, path, 128);
+        if(!openPrefetchFile(job.hash, path)){
+            LOG("Could not prefetch ", job.hash, "\n");
+            job.data[-1] &= ~(1 << 17);
+            dropPrefetch(i);
+            return false;
+        }
+        file = prefetchFile;
+    }
+    file->seek(job.source + job.offset);
+    file->read(reinterpret_cast<char*>(job.data) + job.offset, size);
+    job.offset += size;
+    budget -= size;
+    return true;
+}
+
+void servicePrefetch(u32 budget){
+    for(u32 i = 0; i < prefetchCount && budget; ++i){
+        if(!serviceJob(i, budget))
+            i--;
+    }
+}
+
+// Called before another res file is opened. Jobs still reading from the
+// old one start over against the new one, finished jobs keep their data.
+void retargetPrefetch(){
+    for(u32 i = 0; i < prefetchCount; ++i){
+        auto &job = prefetchQueue[i];
+        if(!job.source || job.offset == job.length)
+            continue;
+        job.data[-1] &= ~(1 << 17);
+        job = {job.hash, nullptr, 0, ~u32{}, 0};
+    }
+}
+
+u32 prefetch(u32 nameHash){
+    if(auto array = pine::arrayFromPtr(nameHash)){
+        u32 len = array[-1] & 0xFFFF;
+        u32 count = 0;
+        for(u32 i=0; i<len; ++i)
+            count += prefetch(array[i]);
+        return count;
+    }
+    if(!nameHash)
+        return 0;
+    if(findPrefetch(nameHash) < prefetchCount)
+        return 1;
+    if(prefetchCount == prefetchCapacity)
+        return 0;
+    prefetchQueue[prefetchCount++] = {nameHash, nullptr, 0, ~u32{}, 0};
+    return 1;
+}
+
+u32 claimPrefetch(u32 nameHash, char *ptr){
+    u32 i = findPrefetch(nameHash);
+    if(i == prefetchCount)
+        return 0;
+
+    u32 budget = ~u32{};
+    if(!serviceJob(i, budget))
+        return 0;
+
+    auto data = prefetchQueue[i].data;
+    auto length = prefetchQueue[i].length;
+    dropPrefetch(i);
+    data[-1] &= ~(1 << 17);
+    if(!ptr)
+        return reinterpret_cast<u32>(data);
+    memcpy(ptr, data, length);
+    return reinterpret_cast<u32>(ptr);
+}
+
 u32 readFile(u32 nameHash, char *ptr){
     auto array = pine::arrayFromPtr(nameHash);
     if(array){
         u32 len = array[-1] & 0xFFFF;
         for(u32 i=0; i<len; ++i){
             array[i] = readFile(array[i], nullptr);
+            pine::gcWriteBarrier(array + i);
             // if(array[i])
             //     LOG("Read ", i, " s:", reinterpret_cast<u32*>(array[i])[-1]&0xFFFF, "\n");
         }
         return nameHash;
     }
 
+    if(prefetchCount){
+        auto ret = claimPrefetch(nameHash, ptr);
+        if(ret)
+            return ret;
+    }
+
     if(resourceFile){
         auto ret = readResource(nameHash, ptr);
         if(ret)
@@ -596,13 +771,13 @@ void sound(u32 num, u32 osc){
 u32 read(u32 key, u32 a, u32 b, u32 c){
     switch(key){
     case pine::hash("\"HOUR"):
-        return ((uint32_t*)0x40024000)[2]/(60*60)%24;
+        return reinterpret_cast<uint32_t*>(pine::memoryMap.rtc)[2]/(60*60)%24;
     case pine::hash("\"MINUTE"):
-        return ((uint32_t*)0x40024000)[2]/60%60;
+        return reinterpret_cast<uint32_t*>(pine::memoryMap.rtc)[2]/60%60;
     case pine::hash("\"SECOND"):
-        return ((uint32_t*)0x40024000)[2]%60;
+        return reinterpret_cast<uint32_t*>(pine::memoryMap.rtc)[2]%60;
     case pine::hash("\"TIMESTAMP"):
-        return ((uint32_t*)0x40024000)[2];
+        return reinterpret_cast<uint32_t*>(pine::memoryMap.rtc)[2];
     case pine::hash("\"FORMAT"):
         fmt = a;
         numPad = b < 15 ? b : 0;
@@ -636,12 +811,44 @@ u32 read(u32 key, u32 a, u32 b, u32 c){
         }
         return 0;
     }
+    case pine::hash("\"PREFETCH"): return prefetch(a);
+    case pine::hash("\"GC"):
+        switch(a){
+        case pine::hash("\"THRESHOLD"): if(b && b <= 0x8000) pine::gcThreshold = b; return pine::gcThreshold;
+        case pine::hash("\"RUNS"): return pine::gcStats.runs;
+        case pine::hash("\"SCANNED"): return pine::gcStats.scanned;
+        case pine::hash("\"FREED"): return pine::gcStats.freed;
+        case pine::hash("\"LIVE"): return pine::gcStats.live;
+        case pine::hash("\"USED"): return pine::gcStats.used;
+        case pine::hash("\"PEAK"): return pine::gcStats.peak;
+        case pine::hash("\"TIME"): return pine::gcStats.time;
+        case pine::hash("\"PAUSE"): return pine::gcStats.maxPause;
+        case pine::hash("\"DUMP"): pine::gcDump(); return pine::gcStats.runs;
+        case pine::hash("\"INCREMENTAL"): if(b < 2) pine::gcIncremental = b && pine::gcCardTable; return pine::gcIncremental;
+        case pine::hash("\"BUDGET"): if(b && b <= 0x2000) pine::gcBudget = b; return pine::gcBudget;
+        case pine::hash("\"HEAP"): return pine::arrayHeap.stats().total;
+        case pine::hash("\"FREE"): return pine::arrayHeap.stats().free;
+        case pine::hash("\"LARGEST"): return pine::arrayHeap.stats().largest;
+        case pine::hash("\"FRAGMENTATION"): return pine::arrayHeap.stats().fragmentation();
+        }
+        return 0;
+    case pine::hash("\"OVERLAY"):
+        switch(a){
+        case pine::hash("\"COUNT"): return pine::overlayCount;
+        case pine::hash("\"HITS"): return pine::overlayStats.hits;
+        case pine::hash("\"MISSES"): return pine::overlayStats.misses;
+        case pine::hash("\"EVICTIONS"): return pine::overlayStats.evictions;
+        case pine::hash("\"LOADED"): return pine::overlayStats.loaded;
+        case pine::hash("\"TIME"): return pine::overlayStats.time;
+        case pine::hash("\"DUMP"): pine::overlayDump(); return pine::overlayStats.misses;
+        }
+        return 0;
     case pine::hash("\"CLEARTEXT"): if(textFiller) textFiller->clear(); return 0;
     case pine::hash("\"SCALE"): PD::fontSize = a; return a;
     case pine::hash("\"VERSION"): return version;
     case pine::hash("\"TILE"):{
         u32 tile = reinterpret_cast<u32>(PD::getTile(a, b));
-        if(tile >=0x10000000 && tile < 0x10008000)
+        if(pine::memoryMap.inHeap(tile))
             tile -= 2;
         return tile;
     }
@@ -679,7 +886,7 @@ void tileshift(u32 x, u32 y){
 void tile(u32 x, u32 y, u32 t){
     if(t > 256){
         auto ptr = reinterpret_cast<const pine::u8 *>(t);
-        ptr += (t >= 0x10000000) ? 2 : 0;
+        ptr += (t >= pine::memoryMap.heap) ? 2 : 0;
         // LOG(ptr, "\n");
         auto w = *ptr++;
         auto h = *ptr++;
@@ -704,33 +911,28 @@ void fillTiles(u32 color){
 }
 
 const char *builtin(u32 hash, u32 index){
-    auto pos = reinterpret_cast<const u32*>(&assets);
-    if(uintptr_t(pos) & 0x3){
+    auto table = reinterpret_cast<const u32*>(&assets);
+    if(uintptr_t(table) & 0x3){
         LOG("Unaligned data\n");
         while(true);
     }
-    auto count = *pos++;
+    auto count = *table++;
+    auto hashes = table;
+    auto offsets = hashes + count;
+    auto slots = reinterpret_cast<const u16*>(offsets + count);
     if( hash == pine::hash("\"INDEX") ){
         // LOG("Hash lookup ", index, "\n");
-        while(count--){
-            auto candidate = *pos++;
-            auto b = reinterpret_cast<const char *>(pos) + 2;
-            if(index-- == 0)
-                return b;
-            u32 s = int(b[0]) * int(b[1]);
-            if(s&3) s += 4;
-            pos += 1 + (s >> 2);
-        }
+        if(index < count)
+            return assets + offsets[index];
     } else {
-        while(count--){
-            auto candidate = *pos++;
-            auto b = reinterpret_cast<const char *>(pos) + 2;
-            if(candidate == hash)
-                return b;
-            u32 s = int(b[0]) * int(b[1]);
-            if(s&3) s += 4;
-            pos += 1 + (s >> 2);
+        u32 low = 0, hi = count;
+        while(low < hi){
+            u32 mid = (low + hi) >> 1;
+            if(hashes[mid] < hash) low = mid + 1;
+            else hi = mid;
         }
+        if(low < count && hashes[low] == hash)
+            return assets + offsets[slots[low]];
     }
     LOG("Resource not found!\n", hash, "\n");
     return 0;
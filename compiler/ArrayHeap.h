@@ -0,0 +1,202 @@
+#pragma once
+
+#include "MemoryMap.h"
+
+namespace pine {
+
+    // Blocks for PINE arrays, carved out of chunks taken with heapAlloc().
+    // Small blocks come in fixed size classes with one free list
+    // each, larger ones are bumped off the top of a chunk. A free block
+    // is tagged with 0xFFFF where an array keeps its length, has its size
+    // in words in the upper half and the next free block in the second word.
+    //
+    // The first chunk is the array region, an eighth of the heap, kept
+    // until clear() so arrays don't interleave with other allocations.
+    // That much stays reserved even for a program with one small array;
+    // only arrays that don't fit in it take further, small chunks from
+    // the general heap.
+    class ArrayHeap {
+        static constexpr u32 chunkWords = 128;
+        static constexpr u32 chunkHeader = 2;
+        static constexpr u32 freeTag = 0xFFFF;
+        static constexpr u32 classCount = 8;
+        static constexpr u8 classWords[classCount] = {2, 4, 6, 8, 12, 16, 24, 32};
+
+        u16 chunks = 0;
+        u16 freeLists[classCount + 1] = {}; // the last list holds odd sizes
+
+        static u32 *ptr(u16 offset){
+            return reinterpret_cast<u32*>(memoryMap.heap + offset);
+        }
+
+        static u16 offset(u32 *ptr){
+            return reinterpret_cast<uintptr_t>(ptr) - memoryMap.heap;
+        }
+
+        static u32 regionWords(){
+            return memoryMap.heapSize >> 5;
+        }
+
+        static u32 classOf(u32 words){
+            for(u32 i=0; i<classCount; ++i){
+                if(words <= classWords[i])
+                    return i;
+            }
+            return classCount;
+        }
+
+        void push(u32 *block, u32 words){
+            u32 c = classOf(words);
+            if(c == classCount || classWords[c] != words)
+                c = classCount;
+            block[0] = freeTag | (words << 16);
+            block[1] = freeLists[c];
+            freeLists[c] = offset(block);
+        }
+
+    public:
+        struct Stats {
+            u32 total;
+            u32 used;
+            u32 free;
+            u32 largest;
+
+            u32 fragmentation(){
+                return free ? 100 - largest * 100 / free : 0;
+            }
+        };
+
+        static constexpr u32 maxLength = 0x2000;
+
+        static u32 blockWords(u32 length){
+            u32 words = length + 1;
+            u32 c = classOf(words);
+            return c < classCount ? classWords[c] : (words + 1) & ~u32{1};
+        }
+
+        u32 *alloc(u32 length){
+            u32 words = blockWords(length);
+            u32 c = classOf(words);
+            if(c < classCount && freeLists[c]){
+                auto block = ptr(freeLists[c]);
+                freeLists[c] = block[1];
+                return block;
+            }
+
+            u32 *prev = nullptr;
+            for(u16 o = freeLists[classCount]; o; o = ptr(o)[1]){
+                auto block = ptr(o);
+                u32 size = block[0] >> 16;
+                if(size >= words){
+                    if(prev) prev[1] = block[1];
+                    else freeLists[classCount] = block[1];
+                    if(size > words)
+                        push(block + words, size - words);
+                    return block;
+                }
+                prev = block;
+            }
+
+            for(u16 c = chunks; c; c = ptr(c)[1]){
+                auto chunk = ptr(c);
+                u32 size = chunk[0] & 0xFFFF;
+                u32 bump = chunk[0] >> 16;
+                if(size - bump >= words){
+                    chunk[0] = size | ((bump + words) << 16);
+                    return chunk + bump;
+                }
+            }
+
+            u32 size = words + chunkHeader;
+            u32 minimum = chunks ? chunkWords : regionWords();
+            if(size < minimum)
+                size = minimum;
+            auto chunk = heapAlloc(size);
+            if(!chunk)
+                return nullptr;
+            chunk[0] = size | ((chunkHeader + words) << 16);
+            chunk[1] = chunks;
+            chunks = offset(chunk);
+            return chunk + chunkHeader;
+        }
+
+        // Only tags the block. Call coalesce() once a batch has been freed.
+        void free(u32 *block){
+            block[0] = freeTag | (blockWords(block[0] & 0xFFFF) << 16);
+        }
+
+        void coalesce(){
+            for(auto &list : freeLists)
+                list = 0;
+
+            u32 *prev = nullptr;
+            for(u16 next = chunks; next;){
+                auto chunk = ptr(next);
+                next = chunk[1];
+                u32 size = chunk[0] & 0xFFFF;
+                u32 bump = chunk[0] >> 16;
+                u32 *run = nullptr;
+                for(u32 pos = chunkHeader; pos < bump;){
+                    auto block = chunk + pos;
+                    if((block[0] & 0xFFFF) == freeTag){
+                        if(!run) run = block;
+                        pos += block[0] >> 16;
+                    }else{
+                        if(run) push(run, block - run);
+                        run = nullptr;
+                        pos += blockWords(block[0] & 0xFFFF);
+                    }
+                }
+                if(run)
+                    bump = run - chunk;
+                if(bump == chunkHeader && next){ // the region is last
+                    if(prev) prev[1] = next;
+                    else chunks = next;
+                    heapFree(chunk);
+                    continue;
+                }
+                chunk[0] = size | (bump << 16);
+                prev = chunk;
+            }
+        }
+
+        void clear(){
+            while(chunks){
+                auto chunk = ptr(chunks);
+                chunks = chunk[1];
+                heapFree(chunk);
+            }
+            for(auto &list : freeLists)
+                list = 0;
+        }
+
+        Stats stats(){
+            Stats stats = {0, 0, 0, 0};
+            for(u16 c = chunks; c; c = ptr(c)[1]){
+                auto chunk = ptr(c);
+                u32 size = chunk[0] & 0xFFFF;
+                u32 bump = chunk[0] >> 16;
+                stats.total += size << 2;
+                for(u32 pos = chunkHeader; pos < bump;){
+                    auto block = chunk + pos;
+                    if((block[0] & 0xFFFF) == freeTag){
+                        u32 words = block[0] >> 16;
+                        stats.free += words << 2;
+                        if((words << 2) > stats.largest)
+                            stats.largest = words << 2;
+                        pos += words;
+                    }else{
+                        u32 words = blockWords(block[0] & 0xFFFF);
+                        stats.used += words << 2;
+                        pos += words;
+                    }
+                }
+                stats.free += (size - bump) << 2;
+                if(((size - bump) << 2) > stats.largest)
+                    stats.largest = (size - bump) << 2;
+            }
+            return stats;
+        }
+    };
+
+}
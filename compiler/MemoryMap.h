@@ -0,0 +1,127 @@
+#pragma once
+
+#include "pineUtils.h"
+
+#ifndef POKITTO
+#include <sys/mman.h>
+#endif
+
+namespace pine {
+
+    // Where PINE keeps its program, globals and arrays, and the device
+    // registers it reads directly. Every address is stored in a u32, so
+    // all regions have to sit below 4GB.
+    struct MemoryMap {
+        u32 code;     // compiled program
+        u32 codeSize;
+        u32 data;     // globals, doubles as scratch space while compiling
+        u32 dataSize;
+        u32 heap;     // arrays, addressed by 16-bit offsets from here
+        u32 heapSize; // at most 0x8000, array headers keep 15 bits of offset
+        u32 buttons;  // GPIO word read by pressed()
+        u32 rtc;      // real time clock, seconds are in the third word
+
+        constexpr u32 codeEnd() const {
+            return code + codeSize;
+        }
+
+        constexpr u32 heapEnd() const {
+            return heap + heapSize;
+        }
+
+        constexpr bool inCode(u32 address) const {
+            return address >= code && address < codeEnd();
+        }
+
+        constexpr bool inHeap(u32 address) const {
+            return address >= heap && address < heapEnd();
+        }
+    };
+
+#ifdef POKITTO
+
+    inline constexpr MemoryMap memoryMap = {
+        0x20000000, 0x800,
+        0x20004000, 0x800,
+        0x10000000, 0x8000,
+        0xA0000020,
+        0x40024000
+    };
+
+    // Memory that compiled code or 16-bit heap offsets point at. The
+    // device's general heap is the heap region.
+    inline u32 *heapAlloc(u32 words){
+        return new u32[words];
+    }
+
+    inline void heapFree(u32 *block){
+        delete[] block;
+    }
+
+#else
+
+    // Filled in by mapHostMemory() before anything is compiled
+    inline MemoryMap memoryMap = {};
+
+    // The host carves the same out of the mapped heap region, first fit.
+    // Each block has a word in front with its size in words, the top bit
+    // set while in use. Word 0 is never handed out, a zero offset means
+    // "none".
+    inline u32 *heapAlloc(u32 words){
+        auto heap = reinterpret_cast<u32*>(uintptr_t(memoryMap.heap));
+        u32 end = memoryMap.heapSize >> 2;
+        for(u32 pos = 1; pos < end;){
+            u32 size = heap[pos] & 0x7FFFFFFF;
+            if(heap[pos] >> 31){
+                pos += size + 1;
+                continue;
+            }
+            while(pos + size + 1 < end && !(heap[pos + size + 1] >> 31))
+                size += heap[pos + size + 1] + 1;
+            if(size > words + 1){
+                heap[pos + words + 1] = size - words - 1;
+                size = words;
+            }
+            if(size >= words){
+                heap[pos] = size | 0x80000000;
+                return heap + pos + 1;
+            }
+            heap[pos] = size;
+            pos += size + 1;
+        }
+        return nullptr;
+    }
+
+    inline void heapFree(u32 *block){
+        if(block)
+            block[-1] &= 0x7FFFFFFF;
+    }
+
+    inline bool mapHostMemory(){
+        // x86-64 code is about three times the size of the same Thumb code
+        constexpr u32 codeSize = 0x2000, dataSize = 0x800, heapSize = 0x8000;
+        constexpr u32 ioSize = 0x1000;
+        int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_32BIT
+        flags |= MAP_32BIT;
+#endif
+        auto base = mmap(nullptr, codeSize + dataSize + heapSize + ioSize,
+                         PROT_READ | PROT_WRITE | PROT_EXEC, flags, -1, 0);
+        if(base == MAP_FAILED || reinterpret_cast<uintptr_t>(base) > 0xFFFFFFFF - 0x10000)
+            return false;
+        u32 address = reinterpret_cast<uintptr_t>(base);
+        memoryMap.heap = address;
+        memoryMap.heapSize = heapSize;
+        memoryMap.code = address + heapSize;
+        memoryMap.codeSize = codeSize;
+        memoryMap.data = memoryMap.code + codeSize;
+        memoryMap.dataSize = dataSize;
+        memoryMap.buttons = memoryMap.data + dataSize;
+        memoryMap.rtc = memoryMap.buttons + 0x20;
+        reinterpret_cast<u32*>(base)[1] = (heapSize >> 2) - 2;
+        return true;
+    }
+
+#endif
+
+}
@@ -1,11 +1,27 @@
 #pragma once
 
 #include "pine.h"
+#include "codegenbc.h"
+#include "ArrayHeap.h"
 #include <MemOps>
 
+#ifndef POKITTO
+#include "codegenx64.h"
+#include <pthread.h>
+#endif
+
 namespace pine {
     
     inline u16 arrays = 0;
+    inline ArrayHeap arrayHeap;
+
+    // Holds the program's compact functions, lives until the next compile
+    inline u8 *bytecode = nullptr;
+
+    inline void releaseBytecode(){
+        heapFree(reinterpret_cast<u32*>(bytecode));
+        bytecode = nullptr;
+    }
 
     struct ArrayHeader {
         u32 *data;
@@ -25,7 +41,7 @@ namespace pine {
 
         void uncompress(u16 v){
             v &= 0x7FFC;
-            data = v ? reinterpret_cast<u32*>(0x10000000 + v) : nullptr;
+            data = v ? reinterpret_cast<u32*>(memoryMap.heap + v) : nullptr;
             if(data){
                 u32 compressed = data[-1];
                 length = static_cast<u16>(compressed);
@@ -61,148 +77,803 @@ namespace pine {
         }
     };
 
-    inline void deleteArrays(){
-        for(ArrayHeader array(arrays); array; ++array){
-            delete[] (array.data - 1);
+    inline constexpr u32 gcDefaultThreshold = 2048;
+    inline u32 gcThreshold = gcDefaultThreshold;
+    inline u32 gcAllocated = 0;
+
+    struct GCStats {
+        u32 runs;
+        u32 scanned;  // arrays scanned while marking
+        u32 freed;    // bytes
+        u32 live;     // bytes still in use after the last collection
+        u32 used;     // bytes in use right now
+        u32 peak;
+        u32 time;     // gcClock ticks spent collecting
+        u32 maxPause;
+    };
+
+    inline GCStats gcStats;
+
+    // Time source for gcStats, set by the platform. Time isn't tracked without it.
+    inline u32 (*gcClock)() = nullptr;
+
+    inline u32 gcStartTimer(){
+        return gcClock ? gcClock() : 0;
+    }
+
+    inline void gcStopTimer(u32 start){
+        if(!gcClock)
+            return;
+        u32 pause = gcClock() - start;
+        gcStats.time += pause;
+        if(pause > gcStats.maxPause)
+            gcStats.maxPause = pause;
+    }
+
+    inline void gcDump(){
+        LOG("GC runs: ", gcStats.runs,
+            " scanned: ", gcStats.scanned,
+            " freed: ", gcStats.freed,
+            " live: ", gcStats.live,
+            " used: ", gcStats.used,
+            " peak: ", gcStats.peak,
+            " time: ", gcStats.time,
+            " max pause: ", gcStats.maxPause, "\n");
+    }
+
+    // Incremental mode spreads a collection over several gcStep() calls,
+    // each scanning at most gcBudget words.
+    inline constexpr u32 gcDefaultBudget = 256;
+    inline bool gcIncremental = false;
+    inline u32 gcBudget = gcDefaultBudget;
+
+    enum class GCPhase : u8 {
+        Idle,
+        Mark,
+        Sweep
+    };
+
+    inline GCPhase gcPhase = GCPhase::Idle;
+    inline u32 gcWorkCount = 0;
+    inline u16 gcScanArray = 0;
+    inline u32 gcScanPos = 0;
+    inline u16 *gcSweepPrev = nullptr;
+
+    // The write barrier. Compiled stores into arrays mark the byte for
+    // the 128 bytes of heap they wrote, so an incremental collection only
+    // rescans what changed after it was scanned. Cards are picked by
+    // address bits 7-14, which tell apart every card of the 32K heap and
+    // keep stores outside it within the table. Compiled code stores the
+    // table's low byte, so the table starts wherever that isn't zero.
+    inline constexpr u32 gcCardShift = 7;
+    inline constexpr u32 gcCardCount = 0x8000 >> gcCardShift;
+    inline u8 *gcCardTable = nullptr;
+    inline u32 gcCardPos = 0;
+
+    inline u8 *gcCards(){
+        return gcCardTable + !(reinterpret_cast<uintptr_t>(gcCardTable) & 0xFF);
+    }
+
+    // The card for heap offset
+    inline u8 &gcCard(u32 offset){
+        return gcCards()[((memoryMap.heap + offset) >> gcCardShift) & (gcCardCount - 1)];
+    }
+
+    inline bool gcInitCards(){
+        if(!gcCardTable)
+            gcCardTable = reinterpret_cast<u8*>(heapAlloc((gcCardCount + 4) >> 2));
+        return gcCardTable != nullptr;
+    }
+
+    inline void gcFreeCards(){
+        heapFree(reinterpret_cast<u32*>(gcCardTable));
+        gcCardTable = nullptr;
+    }
+
+    // For native code storing values into arrays
+    inline void gcWriteBarrier(u32 *slot){
+        if(gcCardTable)
+            gcCard(reinterpret_cast<uintptr_t>(slot) - memoryMap.heap) = 1;
+    }
+
+    template<typename Type>
+    inline bool reserve(Type *&buffer, u32 count, u32 &capacity, u32 growth){
+        if(count < capacity)
+            return true;
+        auto grown = new Type[capacity + growth];
+        if(!grown)
+            return false;
+        for(u32 i=0; i<count; ++i)
+            grown[i] = buffer[i];
+        delete[] buffer;
+        buffer = grown;
+        capacity += growth;
+        return true;
+    }
+
+    // Read-only arrays made from const array literals. They are allocated
+    // outside the GC heap, never scanned and shared by all literals with
+    // the same contents. The header only holds the length.
+    struct ConstArray {
+        u16 offset; // data, relative to the heap window
+        u16 hash;
+    };
+
+    inline constexpr u32 constArrayGrowth = 16;
+    inline ConstArray *constArrays = nullptr;
+    inline u32 constArrayCount = 0;
+    inline u32 constArrayCapacity = 0;
+
+    inline u32 *constArrayData(u32 i){
+        return reinterpret_cast<u32*>(memoryMap.heap + constArrays[i].offset);
+    }
+
+    inline u32 *findConstArray(u32 value){
+        if(!memoryMap.inHeap(value))
+            return nullptr;
+        u16 offset = value - memoryMap.heap;
+        u32 low = 0, hi = constArrayCount;
+        while(low < hi){
+            u32 mid = (low + hi) >> 1;
+            if(constArrays[mid].offset <= offset) low = mid + 1;
+            else hi = mid;
+        }
+        if(!low)
+            return nullptr;
+        auto data = constArrayData(low - 1);
+        if(reinterpret_cast<u32*>(uintptr_t(value)) >= data + (data[-1] & 0xFFFF))
+            return nullptr;
+        return data;
+    }
+
+    inline u32 *constArray(const u32 *data, u32 length){
+        u32 hash = 5381;
+        for(u32 i=0; i<length; ++i)
+            hash = hash * 31 + data[i];
+        hash ^= hash >> 16;
+
+        for(u32 i=0; i<constArrayCount; ++i){
+            if(constArrays[i].hash != u16(hash))
+                continue;
+            auto other = constArrayData(i);
+            if((other[-1] & 0xFFFF) != length)
+                continue;
+            u32 j = 0;
+            while(j < length && other[j] == data[j])
+                ++j;
+            if(j == length)
+                return other;
         }
+
+        if(!reserve(constArrays, constArrayCount, constArrayCapacity, constArrayGrowth))
+            return nullptr;
+        auto block = heapAlloc(length + 1);
+        if(!block)
+            return nullptr;
+        block[0] = length;
+        for(u32 i=0; i<length; ++i)
+            block[i + 1] = data[i];
+
+        u16 offset = reinterpret_cast<uintptr_t>(block + 1) - memoryMap.heap;
+        u32 i = constArrayCount++;
+        for(; i && constArrays[i - 1].offset > offset; --i)
+            constArrays[i] = constArrays[i - 1];
+        constArrays[i] = {offset, u16(hash)};
+        return block + 1;
+    }
+
+    inline void clearConstArrays(){
+        for(u32 i=0; i<constArrayCount; ++i)
+            heapFree(constArrayData(i) - 1);
+        delete[] constArrays;
+        constArrays = nullptr;
+        constArrayCount = constArrayCapacity = 0;
+    }
+
+    // Offsets of all live arrays, sorted by address. The buffer also holds
+    // the mark worklist, so gc() never has to allocate.
+    inline constexpr u32 arrayIndexGrowth = 64;
+    inline u16 *arrayIndex = nullptr;
+    inline u32 arrayIndexCount = 0;
+    inline u32 arrayIndexCapacity = 0;
+
+    inline void deleteArrays(){
+        clearConstArrays();
+        arrayHeap.clear();
         arrays = 0;
+        gcAllocated = 0;
+        gcStats.used = 0;
+        gcPhase = GCPhase::Idle;
+        gcFreeCards();
+        delete[] arrayIndex;
+        arrayIndex = nullptr;
+        arrayIndexCount = 0;
+        arrayIndexCapacity = 0;
+    }
+
+    inline u32 findArray(u32 value){
+        if(!memoryMap.inHeap(value))
+            return ~u32{};
+        u16 offset = value - memoryMap.heap;
+        u32 low = 0, hi = arrayIndexCount;
+        while(low < hi){
+            u32 mid = (low + hi) >> 1;
+            if(arrayIndex[mid] <= offset) low = mid + 1;
+            else hi = mid;
+        }
+        if(!low)
+            return ~u32{};
+        ArrayHeader array(arrayIndex[low - 1]);
+        if(reinterpret_cast<u32*>(uintptr_t(value)) >= array.data + array.length)
+            return ~u32{};
+        return low - 1;
+    }
+
+    inline u16 *gcWork(){
+        return arrayIndex + arrayIndexCapacity;
+    }
+
+    inline bool indexArray(u32 *data){
+        if(arrayIndexCount == arrayIndexCapacity){
+            u32 capacity = arrayIndexCapacity + arrayIndexGrowth;
+            auto index = new u16[capacity * 2];
+            if(!index)
+                return false;
+            for(u32 i=0; i<arrayIndexCount; ++i)
+                index[i] = arrayIndex[i];
+            for(u32 i=0; i<gcWorkCount; ++i)
+                index[capacity + i] = gcWork()[i];
+            delete[] arrayIndex;
+            arrayIndex = index;
+            arrayIndexCapacity = capacity;
+        }
+        u16 offset = reinterpret_cast<uintptr_t>(data) - memoryMap.heap;
+        u32 i = arrayIndexCount++;
+        for(; i && arrayIndex[i - 1] > offset; --i)
+            arrayIndex[i] = arrayIndex[i - 1];
+        arrayIndex[i] = offset;
+        return true;
+    }
+
+    inline u32 arrayPosition(u16 offset){
+        u32 low = 0, hi = arrayIndexCount;
+        while(low < hi){
+            u32 mid = (low + hi) >> 1;
+            if(arrayIndex[mid] < offset) low = mid + 1;
+            else hi = mid;
+        }
+        return low;
     }
 
     inline u32 *arrayFromPtr(u32 x){
-        if(x < 0x10000000 || x >= 0x10008000)
+        u32 i = findArray(x);
+        if(i == ~u32{})
+            return findConstArray(x);
+        return ArrayHeader(arrayIndex[i]).data;
+    }
+
+    // Frame layouts of compiled functions, recorded while compiling. A
+    // frame is the function's stack slots, then the registers its prologue
+    // saved, then the return address.
+    struct StackFrame {
+        u8 slots;
+        u8 saved;
+        u32 pointers[4]; // slots that may hold an array
+    };
+
+    struct CallSite {
+        u16 address; // return address, relative to the code section
+        u16 frame;
+    };
+
+    inline constexpr u32 stackMapGrowth = 32;
+    inline CallSite *callSites = nullptr;
+    inline u32 callSiteCount = 0;
+    inline u32 callSiteCapacity = 0;
+    inline StackFrame *stackFrames = nullptr;
+    inline u32 stackFrameCount = 0;
+    inline u32 stackFrameCapacity = 0;
+    inline bool stackMapsValid = true;
+
+    inline void clearStackMaps(){
+        delete[] callSites;
+        delete[] stackFrames;
+        callSites = nullptr;
+        stackFrames = nullptr;
+        callSiteCount = callSiteCapacity = 0;
+        stackFrameCount = stackFrameCapacity = 0;
+        stackMapsValid = true;
+    }
+
+    // Call sites are reported in code order, before the frame of the
+    // function containing them.
+    inline void recordCallSite(u32 address){
+        if(!stackMapsValid || !reserve(callSites, callSiteCount, callSiteCapacity, stackMapGrowth)){
+            stackMapsValid = false;
+            return;
+        }
+        callSites[callSiteCount++] = {
+            u16(address - memoryMap.code),
+            u16(stackFrameCount)
+        };
+    }
+
+    inline void recordStackFrame(u32 slots, u32 saved, const u32 *pointers){
+        if(!stackMapsValid || !reserve(stackFrames, stackFrameCount, stackFrameCapacity, stackMapGrowth)){
+            stackMapsValid = false;
+            return;
+        }
+        auto &frame = stackFrames[stackFrameCount++];
+        frame.slots = slots;
+        frame.saved = saved;
+        for(u32 i=0; i<4; ++i)
+            frame.pointers[i] = pointers[i];
+    }
+
+    inline CallSite *findCallSite(u32 retaddr){
+        if(!stackMapsValid || !memoryMap.inCode(retaddr))
             return nullptr;
-        auto ptr = reinterpret_cast<u32*>(x);
-        for(ArrayHeader array(arrays); array; ++array){
-            if((array.data <= ptr) && (array.data + (array.length << 2)) > ptr)
-                return array.data;
+        u16 address = (retaddr & ~1) - memoryMap.code;
+        u32 low = 0, hi = callSiteCount;
+        while(low < hi){
+            u32 mid = (low + hi) >> 1;
+            if(callSites[mid].address < address) low = mid + 1;
+            else hi = mid;
         }
-        return nullptr;
+        if(low == callSiteCount || callSites[low].address != address)
+            return nullptr;
+        return &callSites[low];
     }
 
-    inline void gc(u32 **stackBottom, u32 **stackTop, u32 **globals, u32 globalCount){
-        u32 markCount = 0;
-        // LOG("GC\n");
-        for(ArrayHeader array(arrays); array; ++array){
+    inline void gcMark(u32 value){
+        u32 i = findArray(value);
+        if(i == ~u32{})
+            return;
+        ArrayHeader array(arrayIndex[i]);
+        if(array.mark)
+            return;
+        array.mark = true;
+        array.update();
+        gcWork()[gcWorkCount++] = arrayIndex[i];
+    }
+
+    // Scanned in 32-bit words, on a 64-bit host that covers the low half
+    // of every pointer.
+    inline void gcMarkRoots(u32 *stackBottom, u32 *stackTop, u32 *globals, u32 globalCount){
+        for(auto stack = stackBottom; stack < stackTop; ++stack)
+            gcMark(*stack);
+
+        for(u32 global = 0; global < globalCount; ++global)
+            gcMark(globals[global]);
+    }
+
+    inline u32 *gcStackTop(){
+#ifdef POKITTO
+        return reinterpret_cast<u32 *>(memoryMap.heapEnd());
+#else
+        static u32 *top = nullptr;
+        if(!top){
+            pthread_attr_t attr;
+            void *stack;
+            size_t size;
+            pthread_getattr_np(pthread_self(), &attr);
+            pthread_attr_getstack(&attr, &stack, &size);
+            pthread_attr_destroy(&attr);
+            top = reinterpret_cast<u32 *>(reinterpret_cast<uintptr_t>(stack) + size);
+        }
+        return top;
+#endif
+    }
+
+    // frame points at the r4-r7 and return address saved by arrayCtr. As
+    // long as the return addresses lead into compiled code the frames are
+    // walked with their stack maps, anything above that is scanned word
+    // by word.
+    inline void gcMarkFrames(u32 *frame, u32 *stackTop, u32 *globals, u32 globalCount){
+        for(u32 i=0; i<4; ++i)
+            gcMark(frame[i]);
+        u32 retaddr = frame[4];
+        frame += 5;
+        while(auto site = findCallSite(retaddr)){
+            if(frame >= stackTop)
+                break;
+            auto &layout = stackFrames[site->frame];
+            for(u32 i=0; i<layout.slots; ++i){
+                if(layout.pointers[i >> 5] & (1 << (i & 31)))
+                    gcMark(frame[i]);
+            }
+            frame += layout.slots;
+            for(u32 i=0; i<layout.saved; ++i)
+                gcMark(frame[i]);
+            retaddr = frame[layout.saved];
+            frame += layout.saved + 1;
+        }
+        gcMarkRoots(frame, stackTop, globals, globalCount);
+    }
+
+    inline u32 gcBegin(){
+        gcStats.runs++;
+        gcAllocated = 0;
+        gcWorkCount = 0;
+        gcScanArray = 0;
+        gcCardPos = 0;
+        if(gcCardTable)
+            MemOps::set(gcCards(), 0, gcCardCount);
+        for(u32 i=0; i<arrayIndexCount; ++i){
+            ArrayHeader array(arrayIndex[i]);
             array.mark = array.isRoot;
             array.hasPtrs = false;
-            u32 *begin = array.data;
-            u32 *end = array.data + array.length;
+            array.update();
             // if(array.isRoot) LOG("Skip root ", array.data, "\n");
-            if(!array.mark){
-                for(auto stack = stackBottom; stack < stackTop;  ++stack){
-                    if(*stack >= begin && *stack < end){
-                        // LOG("Stack Hit ", stack - stackBottom,  array.mark, " ", begin, ">=", *stack, "<", end, "\n");
-                        array.mark = true;
-                        break;
-                    }
-                }
-            }
-            if(!array.mark){
-                for(u32 global = 0; global < globalCount; ++global){
-                    auto value = globals[global];
-                    if(value >= begin && value < end){
-                        array.mark = true;
-                        // LOG("Static Hit ", stackTop,  array.mark, " ", begin, " ", end, "\n");
-                        break;
-                    }
-                }
+            if(array.mark)
+                gcWork()[gcWorkCount++] = arrayIndex[i];
+        }
+        return arrayIndexCount;
+    }
+
+    // Scans up to budget words from the worklist, returns what's left of it.
+    // An array too big for the budget is resumed on the next call.
+    inline u32 gcDrain(u32 budget){
+        while(budget){
+            if(!gcScanArray){
+                if(!gcWorkCount)
+                    break;
+                gcScanArray = gcWork()[--gcWorkCount];
+                gcScanPos = 0;
+                gcStats.scanned++;
+                budget--;
             }
-            for(auto i=0; i<array.length; ++i){
-                if(array.data[i] >= 0x10000000 && array.data[i] < 0x10008000){
+            ArrayHeader array(gcScanArray);
+            u32 end = array.length;
+            if(end - gcScanPos > budget)
+                end = gcScanPos + budget;
+            budget -= end - gcScanPos;
+            for(; gcScanPos < end; ++gcScanPos){
+                auto value = array.data[gcScanPos];
+                if(memoryMap.inHeap(value)){
                     array.hasPtrs = true;
-                    break;
+                    gcMark(value);
                 }
             }
-            markCount += array.mark;
             array.update();
+            if(gcScanPos == array.length)
+                gcScanArray = 0;
+        }
+        return budget;
+    }
+
+    inline void gcCompact(){
+        u32 live = 0;
+        for(u32 i=0; i<arrayIndexCount; ++i){
+            if(ArrayHeader(arrayIndex[i]).mark)
+                arrayIndex[live++] = arrayIndex[i];
+        }
+        arrayIndexCount = live;
+        gcSweepPrev = &arrays;
+    }
+
+    // Frees up to budget dead arrays, returns true once the list is done.
+    inline bool gcSweep(u32 budget){
+        while(*gcSweepPrev & 0x7FFC){
+            if(!budget--)
+                return false;
+            ArrayHeader array(*gcSweepPrev);
+            if(array.mark){
+                gcSweepPrev = array.nextPtr();
+            }else{
+                u32 size = ArrayHeap::blockWords(array.length) << 2;
+                gcStats.freed += size;
+                gcStats.used -= size;
+                *gcSweepPrev = (*gcSweepPrev & 2) | (array.next & 0x7FFC);
+                // LOG("Collect ", array.data - 1, "\n");
+                arrayHeap.free(array.data - 1);
+            }
         }
+        arrayHeap.coalesce();
+        gcStats.live = gcStats.used;
+        return true;
+    }
 
-        // LOG(markCount, "\n");
+    inline void gc(u32 *frame, u32 *stackTop, u32 *globals, u32 globalCount){
+        // LOG("GC\n");
+        u32 start = gcStartTimer();
+        gcPhase = GCPhase::Idle;
+        gcBegin();
+        gcMarkFrames(frame, stackTop, globals, globalCount);
+        gcDrain(~u32{});
+        gcCompact();
+        gcSweep(~u32{});
+        gcStopTimer(start);
+    }
 
-        while(markCount){
-            markCount = 0;
-            for(ArrayHeader array(arrays); array; ++array){
-                if(array.mark)
+    // Rescans the marked arrays in dirty cards from gcCardPos on, for up
+    // to about budget words. Returns what's left of the budget.
+    inline u32 gcScanCards(u32 budget){
+        for(; gcCardPos < gcCardCount && budget; ++gcCardPos){
+            budget--;
+            u32 start = gcCardPos << gcCardShift;
+            auto &card = gcCard(start);
+            if(!card)
+                continue;
+            card = 0;
+            u32 end = start + (1 << gcCardShift);
+            u32 i = arrayPosition(start);
+            if(i)
+                --i; // may reach into the card
+            for(; i < arrayIndexCount && arrayIndex[i] < end; ++i){
+                ArrayHeader array(arrayIndex[i]);
+                if(!array.mark)
                     continue;
-                u32 *begin = array.data;
-                u32 *end = array.data + array.length;
-                for(ArrayHeader other(arrays); other.data; ++other){
-                    if(!other.mark || !other.hasPtrs)
-                        continue;
-                    for(u32 i=0; i<other.length; ++i){
-                        auto e = reinterpret_cast<u32*>(other.data[i]);
-                        if(e >= begin && e < end){
-                            array.mark = true;
-                            array.update();
-                            markCount += array.hasPtrs;
-                            goto safe;
-                        }
-                    }
+                auto first = reinterpret_cast<u32*>(uintptr_t(memoryMap.heap + start));
+                auto last = reinterpret_cast<u32*>(uintptr_t(memoryMap.heap + end));
+                if(first < array.data) first = array.data;
+                if(last > array.data + array.length) last = array.data + array.length;
+                for(; first < last; ++first){
+                    if(budget) budget--;
+                    if(memoryMap.inHeap(*first))
+                        gcMark(*first);
                 }
-            safe:;
             }
         }
+        return budget;
+    }
 
-        u32 cc = 0, kc = 0;
-        u16 *prev = &arrays;
-        for(ArrayHeader array(arrays); array; ++array){
-            if(array.mark){
-                prev = array.nextPtr();
-            }else{
-                cc++;
-                *prev = (*prev & 2) | (array.next & 0x7FFC);
-                LOG("Collect ", array.data - 1, "\n");
-                delete[] (array.data - 1);
-            }
+    // Stores made between steps are in dirty cards, which get an
+    // incremental pass once the worklist is empty. Marking ends when the
+    // stack, globals and the cards dirtied since then turn up nothing new,
+    // otherwise it goes on with what they found.
+    inline void gcFinishMark(u32 *stackBottom, u32 *stackTop, u32 *globals, u32 globalCount){
+        gcMarkRoots(stackBottom, stackTop, globals, globalCount);
+        gcCardPos = 0;
+        gcScanCards(~u32{});
+        if(gcWorkCount){
+            gcCardPos = 0;
+            return;
         }
+        gcCompact();
+        gcPhase = GCPhase::Sweep;
     }
 
     inline u32 gcLockCount = 0;
     inline u32 globalCount = 0;
-    inline u32* arrayCtr(u32 size){
-        auto stackTop = reinterpret_cast<u32 **>(0x10008000);
-        u32** stackBottom;
-        u32 retaddr;
-        __asm__ volatile(
-            "mov %[stackBottom], SP\n"
-            "mov %[retaddr], LR\n"
-            :
-            [stackBottom] "+l" (stackBottom),
-            [retaddr] "+l" (retaddr)
-            ::"r4", "r5", "r6", "r7");
-        auto globals = reinterpret_cast<u32 **>(0x20004000);
-        if(!gcLockCount)
-            gc(stackBottom, stackTop, globals, globalCount);
-
-        auto array = new u32[size + 1];
+
+    // Called through arrayCtr. frame holds the caller's r4-r7 and return
+    // address, the caller's stack starts right above it.
+    extern "C" inline __attribute__((used)) u32* pineArrayCtr(u32 size, u32 *frame){
+        auto stackTop = gcStackTop();
+        [[maybe_unused]] u32 retaddr = frame[4];
+        auto globals = reinterpret_cast<u32 *>(memoryMap.data);
+        u32 *array = nullptr;
+        if(size < ArrayHeap::maxLength){
+            gcAllocated += ArrayHeap::blockWords(size) << 2;
+            if(!gcLockCount && !(gcIncremental && gcCardTable) && gcAllocated >= gcThreshold)
+                gc(frame, stackTop, globals, globalCount);
+
+            array = arrayHeap.alloc(size);
+            if(!array && !gcLockCount){
+                gc(frame, stackTop, globals, globalCount);
+                array = arrayHeap.alloc(size);
+            }
+            if(array && !indexArray(array + 1)){
+                array[0] = size;
+                arrayHeap.free(array);
+                arrayHeap.coalesce();
+                array = nullptr;
+            }
+        }
         if(!array){
             LOG("Out of Memory ", size, "\n");
-            if(retaddr >= 0x20000000 && retaddr < 0x20000800){
+#ifdef POKITTO
+            if(memoryMap.inCode(retaddr)){
                 reinterpret_cast<u16*>(retaddr&~1)[0] = 0b0111000001000000;
             }
+#endif
             return nullptr;
         }
 
         // LOG("Alloc ", size, " @ ", array, "\n");
 
-        array[0] = size | (u32(arrays) << 16);
-        arrays = reinterpret_cast<uintptr_t>(array + 1) - 0x10000000;
+        gcStats.used += ArrayHeap::blockWords(size) << 2;
+        if(gcStats.used > gcStats.peak)
+            gcStats.peak = gcStats.used;
+
+        // Arrays made during a collection start out marked
+        array[0] = size | (u32(arrays) << 16) | (u32(gcPhase != GCPhase::Idle) << 31);
+        arrays = reinterpret_cast<uintptr_t>(array + 1) - memoryMap.heap;
         for(u32 i=1; i<=size; ++i)
             array[i] = 0;
         return array + 1;
     }
 
+#ifdef POKITTO
+    inline u32 __attribute__((naked)) *arrayCtr(u32 size){
+        __asm__ volatile(
+            ".syntax unified\n"
+            "push {r4, r5, r6, r7, lr}\n"
+            "mov r1, sp\n"
+            "bl pineArrayCtr\n"
+            "pop {r4, r5, r6, r7, pc}\n"
+            );
+    }
+#else
+    // x86-64 frames have no stack maps. The callee saved registers are
+    // spilled into this frame and everything above it is scanned
+    // conservatively.
+    inline __attribute__((noinline)) u32 *arrayCtr(u32 size){
+        __builtin_unwind_init();
+        u32 frame[5] = {};
+        return pineArrayCtr(size, frame);
+    }
+#endif
+
+    // Advances an incremental collection by about budget words of work.
+    // Called between frames, starts a new collection once gcThreshold
+    // bytes have been allocated.
+    inline void gcStep(u32 budget){
+        if(gcLockCount || !gcCardTable || (gcPhase == GCPhase::Idle && gcAllocated < gcThreshold))
+            return;
+        u32 start = gcStartTimer();
+        auto globals = reinterpret_cast<u32 *>(memoryMap.data);
+        if(gcPhase == GCPhase::Idle){
+            gcBegin();
+            gcPhase = GCPhase::Mark;
+            gcMarkRoots(nullptr, nullptr, globals, globalCount);
+        }else if(gcPhase == GCPhase::Mark){
+            budget = gcDrain(budget);
+            if(budget)
+                gcScanCards(budget);
+            if(!gcWorkCount && !gcScanArray && gcCardPos == gcCardCount){
+#ifdef POKITTO
+                u32 *stackBottom;
+                __asm__ volatile(
+                    "mov %[stackBottom], SP\n"
+                    :
+                    [stackBottom] "+l" (stackBottom)
+                    );
+#else
+                __builtin_unwind_init();
+                auto stackBottom = reinterpret_cast<u32 *>(__builtin_frame_address(0));
+#endif
+                gcFinishMark(stackBottom, gcStackTop(), globals, globalCount);
+            }
+        }else if(gcSweep(budget)){
+            gcPhase = GCPhase::Idle;
+        }
+        gcStopTimer(start);
+    }
+
+    // Overlay functions are kept in a file and copied into the end of the
+    // code section when called, evicting the least recently used ones.
+    struct Overlay {
+        u32 offset;   // in overlayFile
+        u32 address;  // where it is loaded, 0 if it isn't
+        u32 lastUse;
+        u16 size;
+        u16 active;   // calls in progress, these pin it in place
+        u8 entry;     // entry point, relative to address
+    };
+
+    struct OverlayStats {
+        u32 hits;
+        u32 misses;
+        u32 evictions;
+        u32 loaded;   // bytes
+        u32 time;     // gcClock ticks spent loading
+    };
+
+    inline Overlay overlays[maxOverlays];
+    inline u32 overlayCount = 0;
+    inline u32 overlayStart = 0, overlayEnd = 0;
+    inline u32 overlayTick = 0;
+    inline OverlayStats overlayStats;
+    inline File overlayFile;
+
+    inline void overlayDump(){
+        LOG("Overlays: ", overlayCount,
+            " hits: ", overlayStats.hits,
+            " misses: ", overlayStats.misses,
+            " evictions: ", overlayStats.evictions,
+            " loaded: ", overlayStats.loaded,
+            " time: ", overlayStats.time, "\n");
+    }
+
+    // Functions are compiled in reference order, so ids can arrive in any order
+    inline bool storeOverlay(u32 id, u32 address, u32 size, u32 entry){
+        if(!overlayCount){
+            overlayFile.close();
+            if(!overlayFile.openRW("pine-2k/overlay.tmp", true, false))
+                return false;
+        }
+        // Overlays nothing references are never compiled or stored
+        while(overlayCount <= id)
+            overlays[overlayCount++] = {};
+        auto &overlay = overlays[id];
+        overlay = {};
+        overlay.offset = overlayFile.tell();
+        overlay.size = size;
+        overlay.entry = entry;
+        return overlayFile.write(reinterpret_cast<void*>(uintptr_t(address)), size) == size;
+    }
+
+    // First gap between loaded overlays that fits size bytes
+    inline u32 findOverlayGap(u32 size){
+        u32 address = overlayStart;
+        while(address + size <= overlayEnd){
+            u32 next = 0;
+            for(u32 i=0; i<overlayCount; ++i){
+                auto &other = overlays[i];
+                if(!other.address || other.address >= address + size || other.address + other.size <= address)
+                    continue;
+                next = std::max(next, (other.address + other.size + 3) & ~3);
+            }
+            if(!next)
+                return address;
+            address = next;
+        }
+        return 0;
+    }
+
+    // Fails if the overlays still running leave no gap big enough
+    inline bool loadOverlay(Overlay &overlay){
+        u32 start = gcStartTimer();
+        u32 address;
+        while(!(address = findOverlayGap(overlay.size))){
+            Overlay *victim = nullptr;
+            for(u32 i=0; i<overlayCount; ++i){
+                auto &other = overlays[i];
+                if(other.address && !other.active && (!victim || other.lastUse < victim->lastUse))
+                    victim = &other;
+            }
+            if(!victim)
+                return false;
+            victim->address = 0;
+            overlayStats.evictions++;
+        }
+        overlayFile.seek(overlay.offset);
+        overlayFile.read(reinterpret_cast<void*>(uintptr_t(address)), overlay.size);
+        overlay.address = address;
+        overlayStats.loaded += overlay.size;
+        if(gcClock)
+            overlayStats.time += gcClock() - start;
+        return true;
+    }
+
+    // Called by the stub of overlay id with the caller's r0-r7
+    inline u32 callOverlay(u32 id, u32 *regs){
+        auto &overlay = overlays[id];
+        if(overlay.address){
+            overlayStats.hits++;
+        }else{
+            overlayStats.misses++;
+            if(!loadOverlay(overlay)){
+                LOG("No room to load overlay ", id, "\n");
+                return regs[0] = 0;
+            }
+        }
+        overlay.lastUse = ++overlayTick;
+        overlay.active++;
+        cg::bytecodeCall(overlay.address + overlay.entry, regs);
+        overlay.active--;
+        return regs[0];
+    }
+
     template<typename SymTable>
     class SimplePine {
-        static constexpr const u32 dataSection = 0x20004000;
-        static constexpr const u32 codeSection = 0x20000000;
+        const u32 dataSection = memoryMap.data;
+        const u32 codeSection = memoryMap.code;
         Tokenizer tok;
+#ifdef POKITTO
         /* * /
            cg::FileWriter writer;
            /*/
         cg::BufferWriter<2048> writer;
         /* */
-        cg::CodeGen<decltype(writer)> cg;
+        cg::CodeGen<decltype(writer)> native;
+#else
+        cg::ByteWriter writer;
+        cg::CodeGenX64<decltype(writer)> native;
+#endif
+        cg::CodeGenBytecode<decltype(native)> cg;
         SymTable& symTable;
         ResTable& resTable;
         Pine<decltype(cg), decltype(symTable)> pine;
@@ -211,13 +882,40 @@ namespace pine {
     public:
         SimplePine(const char *file, ResTable &resTable, SymTable &symTable) :
             tok(file),
+#ifdef POKITTO
             writer /* * / ("pine.bin"), /*/ (reinterpret_cast<void*>(codeSection)) /* */,
-            cg(writer),
+#else
+            writer(reinterpret_cast<void*>(uintptr_t(codeSection)), memoryMap.codeSize),
+#endif
+            native(writer),
+            cg(native, [](u32 size){
+                          bytecode = reinterpret_cast<u8*>(heapAlloc((size + 3) >> 2));
+                          return bytecode;
+                      }),
             symTable(symTable),// ("pine-2k/symbols.tmp"),
             resTable(resTable),
             pine(tok, cg, symTable, resTable, dataSection)
             {
                 gcLockCount = 0;
+                gcThreshold = gcDefaultThreshold;
+                gcAllocated = 0;
+                gcStats = {};
+                gcIncremental = false;
+                gcBudget = gcDefaultBudget;
+                gcPhase = GCPhase::Idle;
+                releaseBytecode();
+                clearStackMaps();
+                pine.setStackMaps(recordCallSite, recordStackFrame);
+                gcFreeCards();
+                pine.setCardTable(+[]() -> u32 {
+                                      if(!gcInitCards())
+                                          return 0;
+                                      gcIncremental = true;
+                                      return reinterpret_cast<uintptr_t>(gcCards());
+                                  }, gcCardShift);
+                overlayCount = 0;
+                overlayStats = {};
+                pine.setOverlays(u32(reinterpret_cast<uintptr_t>(callOverlay)), storeOverlay);
                 pine.setGCLock([](bool locked){
                                    if(locked) gcLockCount++;
                                    else if(gcLockCount) gcLockCount--;
@@ -227,6 +925,13 @@ namespace pine {
                                        array[-1] |= 1 << 17;
                                        return array;
                                    });
+                pine.setConstArrays(
+                    [](const u32 *data, u32 size) -> void * {
+                        return constArray(data, size >> 2);
+                    },
+                    [](u32 ptr){
+                        return findConstArray(ptr) != nullptr;
+                    });
                 pine.setSetRooted([](u32 ptr){
                                       auto array = arrayFromPtr(ptr);
                                       if(array){
@@ -234,7 +939,7 @@ namespace pine {
                                       }
                                   });
                 setConstant("Array", arrayCtr, true, true);
-                MemOps::set(reinterpret_cast<void*>(codeSection), 0, 0x800);
+                MemOps::set(reinterpret_cast<void*>(codeSection), 0, memoryMap.codeSize);
             }
 
         template<typename type>
@@ -277,46 +982,76 @@ namespace pine {
             if(pine.getError())
                 return false;
 
-            u32 uncompiled = ~u32{};
+            // Only functions reachable from the global scope or update get
+            // compiled, each adding the ones it references in turn
+            u32 update = hash("update");
+            for(auto &sym : pine.symbols()){
+                if(sym.scopeId == 0 && sym.hash == update)
+                    sym.setReferenced();
+            }
 
-            do {
-                uncompiled = 0;
+            while(!pine.getError()){
+                u32 id = 0;
                 for(auto &sym : pine.symbols()){
-                    if(sym.type == Sym::UNCOMPILED){
+                    if(sym.type == Sym::UNCOMPILED && sym.isReferenced())
                         break;
-                    }
-                    uncompiled++;
+                    id++;
                 }
-                if(uncompiled < pine.symbols().size()){
-                    pine.parseFunction(codeSection, uncompiled);
-                }else{
+                if(id == pine.symbols().size())
                     break;
-                }
-            } while(!pine.getError());
+                pine.parseFunction(codeSection, id);
+            }
 
             if(pine.getError())
                 return false;
 
-            MemOps::set(reinterpret_cast<void*>(dataSection), 0, 0x800);
+            u32 dropped = 0, droppedBytes = 0;
+            u32 id = 0;
+            for(auto &sym : pine.symbols()){
+                if(sym.type == Sym::UNCOMPILED){
+                    if(!dropped++)
+                        LOG("DROPPED:");
+                    LOG(" ", pine.functionName(id));
+                    u32 length = pine.functionLength(id);
+                    LOG("(", length, ")");
+                    droppedBytes += length;
+                }
+                id++;
+            }
+            if(dropped)
+                LOG(" (", dropped, " unused functions, ", droppedBytes, " bytes of source)\n");
 
-            u32 size = cg.tell();
-            if(size > 2048){
-                LOG("PROGMEM OVERFLOWED BY ", size - 2048, " BYTES\n");
+            MemOps::set(reinterpret_cast<void*>(dataSection), 0, memoryMap.dataSize);
+
+            u32 size = native.tell();
+            if(size > memoryMap.codeSize){
+                LOG("PROGMEM OVERFLOWED BY ", size - memoryMap.codeSize, " BYTES\n");
                 return false;
             }
 
-            auto undefinedFunc = reinterpret_cast<u32>(+[](){
+            // Whatever code doesn't use is where overlays get loaded
+            overlayStart = (codeSection + size + 3) & ~3;
+            overlayEnd = codeSection + memoryMap.codeSize;
+            for(u32 i=0; i<overlayCount; ++i){
+                if(overlayStart + overlays[i].size > overlayEnd){
+                    LOG("OVERLAY ", i, " DOESN'T FIT BY ", overlayStart + overlays[i].size - overlayEnd, " BYTES\n");
+                    return false;
+                }
+            }
+
+            auto undefinedFunc = u32(reinterpret_cast<uintptr_t>(+[](){
                                                             LOG("ERROR: Undefined function call\n");
                                                             while(true);
-                                                        });
+                                                        }));
 
-            u32 id = 0, len = 0;
+            u32 len = 0;
             u32 uninit = 0;
+            id = 0;
             for(auto &sym : pine.symbols()){
                 // if(sym.type == Sym::Type::FUNCTION){
                 //     LOG("Func @ 0x", (void*) sym.kctv, "\n");
                 // }
-                if(!sym.memInit() && !sym.isConstant() && !sym.isTemp()){
+                if(!sym.memInit() && !sym.isConstant() && !sym.isTemp() && sym.type != Sym::UNCOMPILED){
                     pine.setError("Variable not declared", sym.line);
                     return false;
                     LOG("Global ", id, " not declared\n");
@@ -325,7 +1060,7 @@ namespace pine {
                 if(sym.address != 0xFFFF){
                     auto address = reinterpret_cast<u32*>( dataSection + (sym.address << 2) );
                     // LOG("MemInit ", id, " ", (void*) address, " ", (void *) sym.init, "\n");
-                    if(!sym.memInit() && sym.isCalled())
+                    if(!sym.memInit() && sym.isReferenced())
                         sym.setMemInit(undefinedFunc);
                     if(sym.memInit() && sym.init){
                         *address = sym.init;
@@ -338,7 +1073,22 @@ namespace pine {
             if(uninit)
                 LOG("WARNING: ", uninit, " uninitialized variables.\n");
 
-            LOG("PROGMEM: ", cg.tell(), " bytes (", (cg.tell() * 100) / 2048, "%) used.\n");
+            LOG("PROGMEM: ", native.tell(), " bytes (", (native.tell() * 100) / memoryMap.codeSize, "%) used.\n");
+            if(cg.bytecodeSize())
+                LOG("BYTECODE: ", cg.bytecodeSize(), " bytes.\n");
+            if(overlayCount)
+                LOG("OVERLAYS: ", overlayCount, " in ", overlayEnd - overlayStart, " bytes.\n");
+            if(pine.getInlinedCalls())
+                LOG("INLINED: ", pine.getInlinedCalls(), " calls.\n");
+            LOG("REGISTERS: ", pine.getPinnedLocals(), " locals pinned, ", pine.getSpills(), " spills, ",
+                pine.getReloads(), " reloads.\n");
+            if(pine.getStridedArrays())
+                LOG("STRIDES: ", pine.getStridedArrays(), " arrays indexed through a pointer.\n");
+#ifdef POKITTO
+            if(native.peepholeRemoved() || native.peepholeRewritten())
+                LOG("PEEPHOLE: ", native.peepholeRemoved(), " instructions (", native.peepholeRemoved() * 2, " bytes) removed, ",
+                    native.peepholeRewritten(), " loads turned into moves.\n");
+#endif
 
             // writer.seek(0x10 >> 1, true);
             // writer << u16(init)
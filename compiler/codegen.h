@@ -272,21 +272,108 @@ namespace cg {
         }
     };
 
-    template <typename CodeWriter, u32 symTableCapacity = 256, u32 constPoolCapacity = 128, bool verbose = true>
+    // Byte-addressed counterpart of BufferWriter, for variable length
+    // instructions. tell() and seek() count bytes.
+    class ByteWriter {
+        u8 *buffer;
+        u32 capacity;
+        u32 offset = 0;
+        u32 pos = 0;
+        u32 max = 0;
+
+    public:
+        ByteWriter(void *buffer, u32 capacity) : buffer((u8*) buffer), capacity(capacity) {}
+
+        template <typename Type>
+        Type* function() {
+            return reinterpret_cast<Type*>(buffer);
+        }
+
+        template<typename T>
+        ByteWriter& operator << (T value){
+            for(u32 i=0; i<sizeof(T); ++i, ++pos){
+                if(offset + pos < capacity)
+                    buffer[offset + pos] = u8(value >> (i * 8));
+            }
+            if(pos > max) max = pos;
+            return *this;
+        }
+
+        void newChunk(){
+            offset += pos;
+            pos = 0;
+        }
+
+        bool full(){
+            return (offset + pos + 16) >= capacity; // room for the longest sequence
+        }
+
+        u8 *getBuffer(){
+            return buffer;
+        }
+
+        u32 size(){
+            return max;
+        }
+
+        u32 tell(bool abs = false){
+            return abs ? pos + offset : pos;
+        }
+
+        void seek(u32 pos, bool abs = false){
+            if(abs) offset = 0;
+            this->pos = pos;
+        }
+
+        u8 read(){
+            if(offset + pos >= capacity)
+                return 0;
+            return buffer[offset + pos++];
+        }
+    };
+
+    template <typename CodeWriter, u32 symTableCapacity = 512, u32 constPoolCapacity = 128, u32 fixupCapacity = 128, bool verbose = true>
     class CodeGen {
         CodeWriter& writer;
         const char *error = nullptr;
         u32 symCount = 0;
         u32 constCount = 0;
+        u32 fixupCount = 0;
         u32 dataStart = ~u32{};
 
+        // Labels are told apart by the low half of their hash, which is
+        // plenty for the sequential numbers Pine uses.
+        static constexpr u16 unbound = 0xFFFF;
         struct Sym {
-            u32 hash;
-            u32 address;
+            u16 hash;
+            u16 address;
         } symTable[symTableCapacity];
 
+        // Branches to labels that aren't bound yet, patched by label()
+        struct Fixup {
+            u16 position;
+            u16 symId : 15;
+            u16 conditional : 1;
+        } fixups[fixupCapacity];
+
         u32 constPool[constPoolCapacity];
 
+        // LDR literal reaches 1020 bytes forward and B<cond> 256, so long
+        // functions get islands of literals and of veneers, unconditional
+        // branches for conditional ones that can't reach their label. Each
+        // spans from where the code stops to where it resumes, with the
+        // literal words starting at data.
+        static constexpr u32 maxLiteralReach = 1020;
+        static constexpr u32 maxPools = 32;
+        struct Pool {
+            u32 from, data, end;
+            bool literals;
+        } pools[maxPools];
+        u32 poolCount = 0;
+        u32 firstLiteral = 0; // the oldest load still waiting for its pool
+        u32 top = 0;
+        bool holdIsland = false; // set while writing a multi-op sequence
+
         constexpr u32 s(ConditionCode c, u32 p){
             return static_cast<u32>(c) << p;
         }
@@ -328,24 +415,6 @@ namespace cg {
             return (((u>>3)&1) << h) | ((u & 7) << l);
         }
 
-        template<typename OpType>
-        void symRef(Label lbl, OpType& op, u32 opMax){
-            for(u32 i=0; i<symCount; ++i){
-                if( symTable[i].hash == lbl.value ){
-                    op |= i;
-                    if(i > (~u32{} >> (32 - opMax))){
-                        error = "opmax";
-                    }
-                    return;
-                }
-            }
-            if(symCount > (~u32{} >> (32 - opMax))){
-                error = "opmax";
-            }
-            op |= symCount;
-            symTable[symCount++] = { lbl.value, ~u32{} };
-        }
-
         void addrRef(u32 address, u32 &op, u32 opMax){
             u32 i = writer.tell();
             address = ((s32(address) >> 1) - (i + 2));
@@ -396,6 +465,15 @@ namespace cg {
         u32 regConst[15];
         // u8 spReg[256];
 
+        // Registers written and whether anything was called since the last link()
+        u32 written = 0;
+        bool calls = false;
+
+        u32 callRegs(){
+            calls = true;
+            return clearRegs();
+        }
+
         u32 clearRegs(){
             regHasConst = 0;
             // for(u32 i=0; i<256; ++i){
@@ -404,7 +482,210 @@ namespace cg {
             return 0;
         }
 
+        u32 swList(u32 map){
+            written |= map & 0xFF;
+            regHasConst &= ~(map & 0xFF);
+            return map;
+        }
+
+        // Peephole state: the last instruction written, if nothing was
+        // written or seeked to since, and whether a label follows it.
+        u32 lastOp = ~u32{};
+        u32 lastPos = ~u32{};
+        bool labelled = false;
+        u32 removed = 0;
+        u32 rewritten = 0;
+
+        bool lastIs(u32 mask, u32 op){
+            return lastOp != ~u32{} && lastPos == writer.tell(true) && (lastOp & mask) == op;
+        }
+
+        bool branchesTo(u32 symId){
+            return fixupCount && lastIs(0, 0) &&
+                fixups[fixupCount - 1].position + 1u == writer.tell() &&
+                fixups[fixupCount - 1].symId == symId;
+        }
+
+        // Last halfword a pending conditional branch at position can reach
+        static u32 branchLimit(u32 position){
+            return position + 2 + 127;
+        }
+
+        void patch(u32 position, s32 offset, bool conditional){
+            if(offset > (conditional ? 127 : 1023) || offset < (conditional ? -128 : -1024)){
+                error = "Out of range";
+                return;
+            }
+            u32 here = writer.tell();
+            writer.seek(position);
+            u16 op = writer.read();
+            writer.seek(position);
+            writer << u16(op | (offset & (conditional ? 0xFF : 0x7FF)));
+            writer.seek(here);
+        }
+
+        void writeIsland(bool jump, bool literals){
+            u32 conditionals = 0;
+            for(u32 i=0; i<fixupCount; ++i)
+                conditionals += fixups[i].conditional;
+            u32 words = literals ? constCount : 0;
+            // Veneer whatever would be left with less than 64 bytes of reach
+            u32 horizon = writer.tell() + jump + conditionals + 1 + words * 2 + 32;
+            u32 veneers = 0;
+            for(u32 i=0; i<fixupCount; ++i)
+                veneers += fixups[i].conditional && branchLimit(fixups[i].position) < horizon;
+            if(!veneers && !literals)
+                return;
+            if(poolCount == maxPools){
+                error = "Too many pools";
+                return;
+            }
+            auto &pool = pools[poolCount++];
+            pool.from = writer.tell();
+            u32 pad = literals ? (writer.tell(true) + jump + veneers) & 1 : 0;
+            if(jump)
+                writer << u16(0b1110'0000'0000'0000 | (veneers + pad + words * 2 - 1));
+            for(u32 i=0; i<fixupCount; ++i){
+                auto &fixup = fixups[i];
+                if(!fixup.conditional || branchLimit(fixup.position) >= horizon)
+                    continue;
+                patch(fixup.position, s32(writer.tell()) - s32(fixup.position + 2), true);
+                fixup.position = writer.tell();
+                fixup.conditional = false;
+                writer << u16(0b1110'0000'0000'0000);
+            }
+            if(pad)
+                writer << u16(0b1011'1111'0000'0000);
+            pool.data = writer.tell();
+            for(u32 i=0; i<words; ++i){
+                writer << constPool[i];
+            }
+            pool.end = top = writer.tell();
+            pool.literals = literals;
+            if(literals)
+                constCount = 0;
+            lastOp = ~u32{};
+        }
+
+        // Places pending literals and veneers before the oldest load or
+        // conditional branch loses its reach: for free once it's getting
+        // close if execution can't fall through to here, behind a branch
+        // over them when there's no other choice.
+        void checkIsland(){
+            if(holdIsland || writer.tell() < top || !(constCount || fixupCount))
+                return;
+            u32 here = writer.tell(), conditionals = 0, limit = ~u32{};
+            for(u32 i=0; i<fixupCount; ++i){
+                if(!fixups[i].conditional)
+                    continue;
+                conditionals++;
+                if(branchLimit(fixups[i].position) < limit)
+                    limit = branchLimit(fixups[i].position);
+            }
+            u32 reach = constCount ? (here + 2 + conditionals - firstLiteral) * 2 + constCount * 4 : 0;
+            bool literalsDue = reach > maxLiteralReach - 16 || constCount == constPoolCapacity;
+            bool literalsLate = reach > maxLiteralReach / 2;
+            bool branchesDue = here + 1 + 4 > limit;
+            bool branchesLate = here + 32 > limit;
+            bool noFallThrough = !labelled && (
+                lastIs(0xF800, 0b1110'0000'0000'0000) ||                  // B
+                lastIs(0xFF00, 0b1011'1101'0000'0000) ||                  // POP {..., PC}
+                lastIs(0xFF87, 0b0100'0111'0000'0000));                   // BX
+            if(literalsDue || branchesDue)
+                writeIsland(!noFallThrough, literalsDue || literalsLate);
+            else if(noFallThrough && (literalsLate || branchesLate))
+                writeIsland(false, literalsLate);
+        }
+
+        u32 labelId(Label lbl){
+            u16 hash = lbl.value;
+            for(u32 i=0; i<symCount; ++i){
+                if(symTable[i].hash == hash)
+                    return i;
+            }
+            if(symCount == symTableCapacity){
+                error = "Too many labels";
+                return 0;
+            }
+            symTable[symCount] = { hash, unbound };
+            return symCount++;
+        }
+
+        void branch(u16 op, Label lbl){
+            if(error) return;
+            if(verbose) LOGD( reinterpret_cast<void*>(uintptr_t(writer.tell(true) << 1)), ": B\n" );
+            if(writer.full()){
+                error = "Writer Full";
+                return;
+            }
+            u32 symId = labelId(lbl);
+            bool conditional = (op & 0xF000) == 0b1101'0000'0000'0000;
+            checkIsland();
+            holdIsland = true;
+            u32 address = symTable[symId].address;
+            if(address != unbound){
+                s32 offset = s32(address >> 1) - s32(writer.tell() + 2);
+                bool relaxed = conditional && offset < -128;
+                if(relaxed){
+                    // B<!cond> over a B that can reach
+                    emit(op ^ 0x100);
+                    offset--;
+                    op = 0b1110'0000'0000'0000;
+                    conditional = false;
+                }
+                if(offset < (conditional ? -128 : -1024))
+                    error = "Out of range";
+                else
+                    emit(op | (offset & (conditional ? 0xFF : 0x7FF)));
+                // The B<!cond> lands right after the B, where an island
+                // would be taken for code nothing falls through to
+                if(relaxed)
+                    labelled = true;
+            }else if(fixupCount == fixupCapacity){
+                error = "Too many branches";
+            }else{
+                fixups[fixupCount++] = { u16(writer.tell()), u16(symId), conditional };
+                emit(op);
+            }
+            holdIsland = false;
+        }
+
+        void emit(u16 op){
+            checkIsland();
+            if(!labelled){
+                if(lastIs(0xF800, 0b1001'0000'0000'0000) &&
+                   (op & 0xF800) == 0b1001'1000'0000'0000 &&
+                   (op & 0xFF) == (lastOp & 0xFF)){
+                    // STR rt, [SP, #i] then LDR ry, [SP, #i]
+                    u32 rt = (lastOp >> 8) & 7, ry = (op >> 8) & 7;
+                    if(rt == ry){
+                        removed++;
+                        return;
+                    }
+                    op = 0b0100'0110'0000'0000 | (rt << 3) | ry; // MOV ry, rt keeps the flags
+                    rewritten++;
+                }else if(op < 0b0100'0100'0000'0000 &&
+                         lastIs(0xFFC0, 0) &&
+                         ((lastOp >> 3) & 7) == (lastOp & 7)){
+                    // MOVS rd, rd only sets flags, which op sets again
+                    writer.seek(writer.tell() - 1);
+                    removed++;
+                }
+            }
+            writer << op;
+            lastOp = op;
+            lastPos = writer.tell(true);
+            labelled = false;
+            if(writer.tell() > top)
+                top = writer.tell();
+        }
+
     public:
+        // Set in the address of anything called with BLX
+        static constexpr u32 thumbBit = 1;
+        static constexpr bool hasBytecode = false;
+        static constexpr bool hasLinkRegister = true;
+
         CodeGen(CodeWriter& writer) : writer(writer) {}
 
         operator bool () {
@@ -421,6 +702,31 @@ namespace cg {
             return writer.tell(true) << 1;
         }
 
+        // Instructions the peephole rules dropped, and loads they turned into moves
+        u32 peepholeRemoved(){
+            return removed;
+        }
+
+        u32 peepholeRewritten(){
+            return rewritten;
+        }
+
+        // True if nothing was called since the last link()
+        bool isLeaf(){
+            return !calls;
+        }
+
+        // Registers written since the last link()
+        u32 writtenMap(){
+            return written;
+        }
+
+        // Discards the code from pos on. Only valid right after link().
+        void truncate(u32 pos){
+            writer.seek(pos >> 1, true);
+            writer.newChunk();
+        }
+
         void link(){
             if(error){
                 LOG(error, "\n");
@@ -428,14 +734,25 @@ namespace cg {
                 return;
             }
             regHasConst = 0;
+            written = 0;
+            calls = false;
+            lastOp = ~u32{};
             LOGD("Linking\n");
+            if(fixupCount){
+                error = "Unresolved Symbol";
+                return;
+            }
             u32 end = writer.tell();
+            u32 pool = 0;
             writer.seek(0);
             for(u32 i = 0; i < end && i < dataStart; ++i){
+                if(pool < poolCount && i == pools[pool].from){
+                    i = pools[pool].end - 1;
+                    writer.seek(pools[pool++].end);
+                    continue;
+                }
+
                 u16 op = writer.read();
-                u32 bits = 0;
-                u16 low = 0;
-                bool signedAddress = false;
 
                 LOGD(i << 1, " ", op, "\n");
 
@@ -449,7 +766,14 @@ namespace cg {
                     LOGD("Found UDF ", skip, "\n");
                     continue;
                 } else if( (op & 0xF800) == 0b0100'1000'0000'0000 ){
-                    u32 skip = (((dataStart) - (i + 1)) >> 1) + (op & 0xFF);
+                    u32 literals = pool;
+                    while(literals < poolCount && !pools[literals].literals)
+                        literals++;
+                    if(literals == poolCount){
+                        error = "Literal without pool";
+                        return;
+                    }
+                    u32 skip = (((pools[literals].data) - (i + 1)) >> 1) + (op & 0xFF);
                     if(skip > 0xFF){
                         error = "Out of range";
                         return;
@@ -459,64 +783,6 @@ namespace cg {
                     writer << u16(op);
                     LOGD("Found const ref\n");
                     continue;
-                } else if( (op & 0xF000) == 0b1101'0000'0000'0000 ){ bits = 8; signedAddress = true; }
-                else if( (op & 0xF800) == 0b1110'0000'0000'0000 ) bits = 11;
-                else if( (op & 0xF800) == 0b1111'0000'0000'0000 ){
-                    continue;
-                    // low = writer.read();
-                    // if( (low & 0xD000) == 0b1101'0000'0000'0000 ){
-                    //     // LOG("low=", low, "\n");
-                    //     bits = 10;
-                    //     signedAddress = true;
-                    // }else continue;
-                }
-                else continue;
-
-                u32 addrMask = ~u32{} >> (32 - bits);
-                u32 symId = op & addrMask;
-                op &= ~addrMask;
-                u32 address = symTable[symId].address;
-                if( address == ~u32{} ){
-                    error = "Unresolved Symbol";
-                    return;
-                }
-
-                address = ((s32(address) >> 1) - (i + 2));
-                writer.seek(i);
-                u32 paddress = s32(address) < 0 ? -address : address;
-                if(signedAddress) paddress <<= 1;
-
-                if(low){
-                    // if(paddress > 0x7fffff){
-                    //     error = "Out of range";
-                    //     LOGD("ADDR: ", (void*)address, "\n");
-                    // }
-                    // u32 imm11 = address & 0x7FF;
-                    // u32 imm10 = (address >> 11) & 0x3FF;
-                    // u32 I2 = (address >> 21) & 1;
-                    // u32 I1 = (address >> 22) & 1;
-                    // u32 S = s32(address) < 0;
-                    // u32 J2 = !(I2 ^ S);
-                    // u32 J1 = !(I1 ^ S);
-                    // u16 H = 0xF000 | (S << 10) | imm10;
-                    // u16 L = 0xD000 | (J1 << 13) | (J2 << 11) | imm11;
-
-                    // // LOG("J ",
-                    // //     (void*) ((u32(H)<<16) | L),
-                    // //     " a:", (void*) symTable[symId].address,
-                    // //     " i:", i,
-                    // //     " s:", S,
-                    // //     "\n");
-
-                    // writer << H << L;
-                    // ++i;
-                }else{
-                    if((paddress & addrMask) != paddress){
-                        error = "Out of range";
-                        LOGD((void*)address, " # ", (void*)addrMask, "\n");
-                    }
-                    address = address & addrMask;
-                    writer << u16(op | address);
                 }
             }
 
@@ -524,6 +790,9 @@ namespace cg {
             writer.newChunk();
             constCount = 0;
             symCount = 0;
+            poolCount = 0;
+            top = 0;
+            dataStart = ~u32{};
         }
 
 #define OP16(NAME, ARGS, OP)                                    \
@@ -531,17 +800,7 @@ namespace cg {
             if(error) return;                                   \
             if(verbose) LOGD( reinterpret_cast<void*>(uintptr_t(writer.tell(true) << 1)), ": ", #NAME, " (L", __LINE__, ")\n" ); \
             if(writer.full()) error = "Writer Full";            \
-            else writer << u16(OP);                             \
-        }
-
-#define OP16L(NAME, ARGS, SYMBOL, OPMAX, OP)                    \
-        void NAME ARGS {                                        \
-            if(error) return;                                   \
-            if(verbose) LOGD( reinterpret_cast<void*>(uintptr_t(writer.tell(true) << 1)), ": ", #NAME, " (L", __LINE__, ")\n" ); \
-            auto op = u16(OP);                                  \
-            symRef(SYMBOL, op, OPMAX);                          \
-            if(writer.full()) error = "Writer Full";            \
-            else writer << op;                                  \
+            else emit(u16(OP));                                 \
         }
 
 #define OP32(NAME, ARGS, OP)                                    \
@@ -569,17 +828,31 @@ namespace cg {
 
         void label(Label lbl) {
             clearRegs();
-            for(u32 i=0; i<symCount; ++i){
-                if(symTable[i].hash == lbl.value){
-                    if(symTable[i].address != ~u32{}){
-                        error = "Symbol redeclared";
-                        return;
-                    }
-                    symTable[i].address = writer.tell() << 1;
-                    return;
-                }
+            u32 i = labelId(lbl);
+            if(error) return;
+            if(symTable[i].address != unbound){
+                error = "Symbol redeclared";
+                return;
+            }
+            if(!labelled && branchesTo(i)){
+                // Branch to the next instruction
+                writer.seek(writer.tell() - 1);
+                fixupCount--;
+                lastOp = ~u32{};
+                removed++;
             }
-            symTable[symCount++] = { lbl.value, writer.tell() << 1 };
+            checkIsland();
+            u32 here = writer.tell(), kept = 0;
+            symTable[i].address = here << 1;
+            for(u32 j=0; j<fixupCount; ++j){
+                auto fixup = fixups[j];
+                if(fixup.symId == i)
+                    patch(fixup.position, s32(here) - s32(fixup.position + 2), fixup.conditional);
+                else
+                    fixups[kept++] = fixup;
+            }
+            fixupCount = kept;
+            labelled = true;
         }
 
         CodeGen& operator [] (Label lbl){
@@ -589,17 +862,7 @@ namespace cg {
 
         void POOL(){
             if(error) return;
-            dataStart = writer.tell();
-            if(writer.tell(true) & 1){
-                NOP();
-                dataStart++;
-            }
-            // LOGD("POOL ", reinterpret_cast<void*>(dataStart << 1), "\n");
-            for(u32 i=0; i<constCount; ++i){
-                // LOGD("CONST ", i, " ", reinterpret_cast<void*>(constPool[i]), "\n");
-                writer << constPool[i];
-            }
-            constCount = 0;
+            writeIsland(false, true);
         }
 
         void U32(u32 v){
@@ -662,17 +925,21 @@ namespace cg {
 
         OP16(ASRS, (RL rdn, RL rm), (0b0100'0001'0000'0000 | s(rm, 3) | sw(rdn, 0)))
 
-        OP16L(B, (ConditionCode cc, Label label), label, 8, (0b1101'0000'0000'0000 | s(cc, 8)))
+        void B(ConditionCode cc, Label label){
+            branch(0b1101'0000'0000'0000 | s(cc, 8), label);
+        }
 
-        OP16L(B, (Label label), label, 11, (0b1110'0000'0000'0000))
+        void B(Label label){
+            branch(0b1110'0000'0000'0000, label);
+        }
 
         OP16(BIC, (RL rdn, RL rm), (0b0100'0011'1000'0000 | s(rm, 3) | sw(rdn, 0)))
 
         OP16(BKPT, (I8 i), (0b1011'1110'0000'0000 | s(i, 0)))
 
-        OP32L(BL, (u32 address), address, (0b1111'0000'0000'0000'1101'0000'0000'0000 | clearRegs()))
+        OP32L(BL, (u32 address), address, (0b1111'0000'0000'0000'1101'0000'0000'0000 | callRegs()))
 
-        OP16(BLX, (RL rm), (0b0100'0111'1000'0000 | s(rm, 3) | clearRegs()))
+        OP16(BLX, (RL rm), (0b0100'0111'1000'0000 | s(rm, 3) | callRegs()))
 
         OP16(BX, (RX rm), (0b0100'0111'0000'0000 | s(rm, 3)))
 
@@ -687,7 +954,7 @@ namespace cg {
         OP16(EORS, (RL rdn, RL rm), (0b0100'0000'0100'0000 | s(rm, 3) | sw(rdn, 0)))
 
         template<typename ... Args>
-            OP16(LDM, (RL rn, Args ... rl), (0b1100'1000'0000'0000 | sw(rn, 8) | (... | (1<<rl.value))));
+            OP16(LDM, (RL rn, Args ... rl), (0b1100'1000'0000'0000 | sw(rn, 8) | swList((... | (1<<rl.value)))));
 
         void setConst(RL rl, u32 imm){
             regHasConst |= 1 << rl.value;
@@ -699,6 +966,7 @@ namespace cg {
         }
 
         void clearConst(RL rl){
+            written |= 1 << rl.value;
             regHasConst &= ~(1 << rl.value);
             // for(u32 i=0; i<256; ++i){
             //     if(spReg[i] == rl.value){
@@ -717,50 +985,99 @@ namespace cg {
         }
         */
 
+        bool isPooled(u32 imm){
+            for(u32 i=0; i<constCount; ++i){
+                if(constPool[i] == imm)
+                    return true;
+            }
+            return false;
+        }
+
+        // Builds imm in rt without touching the literal pool if that is
+        // cheaper, leaving the flags set from the result. On the M0+ every
+        // form here costs 2 bytes and a cycle per instruction, while a pool
+        // load is 2 bytes and 2 cycles plus a 4 byte entry if the value is
+        // not pooled yet: one instruction always wins, a pair only beats a
+        // new entry.
         bool tryLDRS(RL rt, u32 imm){
-            if(hasConst(rt) && regConst[rt.value] == imm)
+            // A wider value may have come from the pool, without flags
+            if(hasConst(rt) && regConst[rt.value] == imm && (imm & ~0xFF) == 0)
                 return true;
 
             if((imm & ~0xFF) == 0){
                 MOVS(rt, imm);
                 setConst(rt, imm);
                 return true;
-            // }else{
-            //     u32 b = imm;
-            //     u32 tz = 0;
-            //     while(!(b & 1)){
-            //         tz++;
-            //         b >>= 1;
-            //     }
-            //     if((b & ~0xFF) == 0){
-            //         MOVS(rt, b);
-            //         LSLS(rt, rt, tz);
-            //         return true;
-            //     }
             }
 
-/*
-            for(int i=0; i<13; ++i){
-                if(!hasConst(RegLow(i))) continue;
-                int d = imm - regConst[i];
-                if(d > 0 && d <= 7){
-                    ADDS(rt, RegLow(i), d);
-                } else if(d < 0 && d >= -7){
-                    SUBS(rt, RegLow(i), -d);
-                } else if(d == 0){
-                    MOVS(rt, RegLow(i));
-                } else continue;
+            if(hasConst(rt)){
+                u32 d = imm - regConst[rt.value];
+                if(d <= 0xFF){
+                    ADDS(rt, d);
+                    setConst(rt, imm);
+                    return true;
+                }
+                if(-d <= 0xFF){
+                    SUBS(rt, -d);
+                    setConst(rt, imm);
+                    return true;
+                }
+            }
+
+            for(u32 i=0; i<8; ++i){
+                if(i == rt.value || !hasConst(RL(i)))
+                    continue;
+                u32 d = imm - regConst[i];
+                if(d == 0){
+                    MOVS(rt, RL(i));
+                }else if(d <= 7){
+                    ADDS(rt, RL(i), d);
+                }else if(-d <= 7){
+                    SUBS(rt, RL(i), -d);
+                }else if(imm == ~regConst[i]){
+                    MVNS(rt, RL(i));
+                }else continue;
                 setConst(rt, imm);
                 return true;
             }
-*/
 
-            return false;
+            if(isPooled(imm))
+                return false;
+
+            u32 tz = 0;
+            while(!((imm >> tz) & 1))
+                tz++;
+            if(((imm >> tz) & ~0xFF) == 0){
+                MOVS(rt, imm >> tz);
+                LSLS(rt, rt, tz);
+            }else if((~imm & ~0xFF) == 0){
+                MOVS(rt, ~imm);
+                MVNS(rt, rt);
+            }else if(imm - 0xFF <= 0xFF){
+                MOVS(rt, 0xFF);
+                ADDS(rt, imm - 0xFF);
+            }else return false;
+            setConst(rt, imm);
+            return true;
         }
 
         void LDR(RL rt, u32 imm){
-            if(hasConst(rt) && regConst[rt.value] == imm)
+            if(hasConst(rt) && regConst[rt.value] == imm){
+                if(imm & ~0xFF)
+                    removed++; // a repeated literal load
                 return;
+            }
+            for(u32 i=0; i<8; ++i){
+                if(hasConst(RL(i)) && regConst[i] == imm){
+                    MOV(rt, RL(i));
+                    setConst(rt, imm);
+                    rewritten++; // the literal is already in a register
+                    return;
+                }
+            }
+            checkIsland();
+            if(!constCount)
+                firstLiteral = writer.tell();
             u32 offset = constCount;
             for(u32 i=0; i<constCount; ++i){
                 if(constPool[i] == imm){
@@ -771,8 +1088,10 @@ namespace cg {
             if(offset == constCount){
                 constPool[constCount++] = imm;
             }
+            holdIsland = true;
             LDR(rt, PC, offset << 2);
-            // setConst(rt, imm);
+            holdIsland = false;
+            setConst(rt, imm);
         }
 
         void LDRS(RL rt, u32 imm){
@@ -783,7 +1102,9 @@ namespace cg {
         }
 
         void LDRI(RL rt, u32 imm, bool preserveStatus = false){
-            if(!preserveStatus){
+            // LDR skips a value rt already holds
+            bool loaded = hasConst(rt) && regConst[rt.value] == imm;
+            if(!preserveStatus && !loaded){
                 if(tryLDRS(rt, imm))
                     return;
             }
@@ -851,7 +1172,7 @@ namespace cg {
 
         OP16(MOVS, (RL rd, I8 imm), (0b0010'0000'0000'0000 | sw(rd, 8) | s(imm, 0)))
 
-        OP16(MOV, (RX rd, RX rm), (0b0100'0110'0000'0000 | sw(rm, 3) | s(rd, 7, 0)))
+        OP16(MOV, (RX rd, RX rm), (0b0100'0110'0000'0000 | s(rm, 3) | sw(rd, 7, 0)))
 
         OP16(MOVS, (RL rd, RL rm), (s(rm, 3) | sw(rd, 0)))
 
@@ -868,9 +1189,9 @@ namespace cg {
         OP16(ORRS, (RL rdn, RL rm), (0b0100'0011'0000'0000 | sw(rdn, 0) | s(rm, 3)))
 
         template<typename ... Arg>
-        OP16(POP, (Arg ... arg), (0b1011'1100'0000'0000 | (... | (1 << (arg.value == 15 ? 8 : arg.value)))))
+        OP16(POP, (Arg ... arg), (0b1011'1100'0000'0000 | swList((... | (1 << (arg.value == 15 ? 8 : arg.value))))))
 
-        OP16(POP, (u32 map), (0b1011'1100'0000'0000 | map))
+        OP16(POP, (u32 map), (0b1011'1100'0000'0000 | swList(map)))
 
         template<typename ... Arg>
         OP16(PUSH, (Arg ... arg), (0b1011'0100'0000'0000 | (... | (1 << (arg.value == 14 ? 8 : arg.value)))))
@@ -890,7 +1211,7 @@ namespace cg {
         OP16(SBCS, (RL rdn, RL rm), (0b0100'0001'1000'0000 | s(rm, 3) | sw(rdn, 0)))
 
         template<typename ... Arg>
-        OP16(STMIA, (RL rn, Arg ... arg), (0b1100'0000'0000'0000 | s(rn, 8) | (... | (1 << arg.value))))
+        OP16(STMIA, (RL rn, Arg ... arg), (0b1100'0000'0000'0000 | sw(rn, 8) | (... | (1 << arg.value))))
 
         OP16(STR, (RL rt, RL rn, Imm<5, 2> imm = 0), (0b0110'0000'0000'0000 | s(imm, 6) | s(rn, 3) | s(rt, 0)))
 
@@ -928,6 +1249,18 @@ namespace cg {
 
         OP16(SUB, (SP_t, Imm<7, 2> imm), (0b1011'0000'1000'0000 | s(imm, 0)))
 
+        // Entry point that calls handler(context, r0-r7) and returns its r0
+        void STUB(u32 handler, u32 context){
+            PUSH(R0, R1, R2, R3, R4, R5, R6, R7, LR);
+            ADD(R1, SP, 0);
+            LDR(R0, context);
+            LDR(R2, handler);
+            BLX(R2);
+            ADD(SP, 16);
+            POP(R4, R5, R6, R7, PC);
+            POOL();
+        }
+
         OP16(SVC, (I8 imm), (0b1101'1111'0000'0000 | s(imm, 0)))
 
         OP16(SXTB, (RL rd, RL rm), (0b1011'0010'0100'0000 | s(rm, 3) | sw(rd, 0)))
@@ -945,7 +1278,6 @@ namespace cg {
 #undef OP32
 #undef OP32L
 #undef OP16
-#undef OP16L
 
 
     };
@@ -0,0 +1,871 @@
+#pragma once
+
+#include "codegen.h"
+
+namespace cg {
+
+    // Register based bytecode with the same registers and flags as the
+    // native code, so compiled functions can mix freely. Operands follow
+    // the opcode: d/n/m are registers, packed two per byte.
+    enum Bytecode : u8 {
+        BC_RET,         // return r0
+        BC_ENTER,       // [words] reserve stack slots, 0 is a no-op
+        BC_BKPT,
+
+        BC_ADCS,        // [d | m << 4]
+        BC_SBCS,
+        BC_ANDS,
+        BC_ORRS,
+        BC_EORS,
+        BC_MULS,
+        BC_ADDS,
+        BC_SUBS,
+        BC_LSLS,
+        BC_LSRS,
+        BC_ASRS,
+        BC_MOVS,
+        BC_MOV,         // leaves the flags alone
+        BC_MVNS,
+        BC_RSBS,
+        BC_CMP,
+
+        BC_ADD3,        // [d | n << 4][m]
+        BC_SUB3,
+        BC_LDR,
+        BC_LDRB,
+        BC_LDRH,
+        BC_STR,
+        BC_STRB,
+
+        BC_ADDRI,       // [d | n << 4][imm8], offsets in bytes
+        BC_SUBRI,
+        BC_LSLI,
+        BC_LSRI,
+        BC_ASRI,
+        BC_MODI,
+        BC_LDRI,
+        BC_LDRBI,
+        BC_LDRHI,
+        BC_STRI,
+        BC_STRBI,
+
+        BC_LDM,         // [n][register mask]
+        BC_CALL,        // [address32]
+        BC_CALLR,       // [m]
+
+        BC_B,           // + condition, 14 is always. [rel16] from the next op
+        BC_MOVI = BC_B + 15, // + d. [imm8]
+        BC_ADDI = BC_MOVI + 8,
+        BC_SUBI = BC_ADDI + 8,
+        BC_CMPI = BC_SUBI + 8,
+        BC_LDRSP = BC_CMPI + 8, // [words]
+        BC_STRSP = BC_LDRSP + 8,
+        BC_LDR32 = BC_STRSP + 8, // + d. [imm32], leaves the flags alone
+        BC_END = BC_LDR32 + 8
+    };
+
+    // Calls a native or compiled function with r0-r6 loaded from regs and
+    // stores the r0/r1 it returns back.
+#ifdef POKITTO
+    inline void __attribute__((naked)) bytecodeCall(u32 target, u32 *regs){
+        __asm__ volatile(
+            ".syntax unified\n"
+            "push {r4, r5, r6, r7, lr}\n"
+            "push {r1}\n"
+            "mov ip, r0\n"
+            "ldr r4, [r1, #16]\n"
+            "ldr r5, [r1, #20]\n"
+            "ldr r6, [r1, #24]\n"
+            "ldr r0, [r1, #0]\n"
+            "ldr r2, [r1, #8]\n"
+            "ldr r3, [r1, #12]\n"
+            "ldr r1, [r1, #4]\n"
+            "blx ip\n"
+            "pop {r2}\n"
+            "str r0, [r2, #0]\n"
+            "str r1, [r2, #4]\n"
+            "pop {r4, r5, r6, r7, pc}\n"
+            );
+    }
+#else
+    // target arrives in edi, regs in rsi
+    inline void __attribute__((naked)) bytecodeCall(u32, u32 *){
+        __asm__ volatile(
+            "push %rbx\n"
+            "push %r12\n"
+            "push %r13\n"
+            "push %r14\n"
+            "push %rsi\n"
+            "mov %edi, %eax\n"
+            "mov %rsi, %r11\n"
+            "mov 0(%r11), %edi\n"
+            "mov 4(%r11), %esi\n"
+            "mov 8(%r11), %edx\n"
+            "mov 12(%r11), %ecx\n"
+            "mov 16(%r11), %ebx\n"
+            "mov 20(%r11), %r12d\n"
+            "mov 24(%r11), %r13d\n"
+            "call *%rax\n"
+            "pop %rsi\n"
+            "mov %eax, 0(%rsi)\n"
+            "shr $32, %rax\n"
+            "mov %eax, 4(%rsi)\n"
+            "pop %r14\n"
+            "pop %r13\n"
+            "pop %r12\n"
+            "pop %rbx\n"
+            "ret\n"
+            );
+    }
+#endif
+
+    // Runs one bytecode function. Entered through the native stub the
+    // code generator places in front of it, with the caller's r0-r7.
+    // Registers and stack slots stay in this frame, where the garbage
+    // collector's conservative stack scan finds them.
+    inline u32 __attribute__((noinline)) runBytecode(u32 code, u32 *args){
+        auto pc = reinterpret_cast<const u8*>(uintptr_t(code));
+        u32 r[8];
+        u32 *sp = nullptr;
+        u32 nz = 1, c = 0, v = 0;
+
+        for(u32 i=0; i<8; ++i)
+            r[i] = args[i];
+
+        auto mem = [](u32 address){
+            return reinterpret_cast<u8*>(uintptr_t(address));
+        };
+
+        auto add = [&](u32 a, u32 b, u32 carry){
+            u32 res = a + b + carry;
+            c = carry ? res <= a : res < a;
+            v = ((a ^ res) & (b ^ res)) >> 31;
+            nz = res;
+            return res;
+        };
+
+        auto sub = [&](u32 a, u32 b, u32 carry){
+            return add(a, ~b, carry);
+        };
+
+        while(true){
+            u32 op = *pc++;
+
+            if(op >= BC_MOVI){
+                u32 d = (op - BC_MOVI) & 7;
+                switch((op - BC_MOVI) >> 3){
+                case 0: r[d] = nz = *pc++; break;
+                case 1: r[d] = add(r[d], *pc++, 0); break;
+                case 2: r[d] = sub(r[d], *pc++, 1); break;
+                case 3: sub(r[d], *pc++, 1); break;
+                case 4: r[d] = sp[*pc++]; break;
+                case 5: sp[*pc++] = r[d]; break;
+                default:
+                    r[d] = pc[0] | (pc[1] << 8) | (pc[2] << 16) | (u32(pc[3]) << 24);
+                    pc += 4;
+                    break;
+                }
+                continue;
+            }
+
+            if(op >= BC_B){
+                s32 rel = int16_t(pc[0] | (pc[1] << 8));
+                pc += 2;
+                bool n = nz >> 31, z = !nz, taken;
+                switch(op - BC_B){
+                case EQ: taken = z; break;
+                case NE: taken = !z; break;
+                case CS: taken = c; break;
+                case CC: taken = !c; break;
+                case MI: taken = n; break;
+                case PL: taken = !n; break;
+                case VS: taken = v; break;
+                case VC: taken = !v; break;
+                case HI: taken = c && !z; break;
+                case LS: taken = !c || z; break;
+                case GE: taken = n == v; break;
+                case LT: taken = n != v; break;
+                case GT: taken = !z && n == v; break;
+                case LE: taken = z || n != v; break;
+                default: taken = true; break;
+                }
+                if(taken)
+                    pc += rel;
+                continue;
+            }
+
+            if(op >= BC_ADCS && op <= BC_CMP){
+                u32 d = *pc & 7, m = (*pc++ >> 4) & 7;
+                u32 a = r[d], b = r[m];
+                switch(op){
+                case BC_ADCS: r[d] = add(a, b, c); break;
+                case BC_SBCS: r[d] = sub(a, b, c); break;
+                case BC_ANDS: r[d] = nz = a & b; break;
+                case BC_ORRS: r[d] = nz = a | b; break;
+                case BC_EORS: r[d] = nz = a ^ b; break;
+                case BC_MULS: r[d] = nz = a * b; break;
+                case BC_ADDS: r[d] = add(a, b, 0); break;
+                case BC_SUBS: r[d] = sub(a, b, 1); break;
+                case BC_LSLS:
+                    b &= 0xFF;
+                    if(b) c = b <= 32 ? (uint64_t(a) << b) >> 32 & 1 : 0;
+                    r[d] = nz = b < 32 ? a << b : 0;
+                    break;
+                case BC_LSRS:
+                    b &= 0xFF;
+                    if(b) c = b <= 32 ? (a >> (b - 1)) & 1 : 0;
+                    r[d] = nz = b < 32 ? a >> b : 0;
+                    break;
+                case BC_ASRS:
+                    b &= 0xFF;
+                    if(b > 31) b = 31;
+                    if(b) c = (s32(a) >> (b - 1)) & 1;
+                    r[d] = nz = s32(a) >> b;
+                    break;
+                case BC_MOVS: r[d] = nz = b; break;
+                case BC_MOV: r[d] = b; break;
+                case BC_MVNS: r[d] = nz = ~b; break;
+                case BC_RSBS: r[d] = sub(0, b, 1); break;
+                default: sub(a, b, 1); break;
+                }
+                continue;
+            }
+
+            if(op >= BC_ADD3 && op <= BC_STRB){
+                u32 d = *pc & 7, n = (*pc++ >> 4) & 7;
+                u32 m = *pc++ & 7;
+                u32 address = r[n] + r[m];
+                switch(op){
+                case BC_ADD3: r[d] = add(r[n], r[m], 0); break;
+                case BC_SUB3: r[d] = sub(r[n], r[m], 1); break;
+                case BC_LDR: r[d] = *reinterpret_cast<u32*>(mem(address)); break;
+                case BC_LDRB: r[d] = *mem(address); break;
+                case BC_LDRH: r[d] = *reinterpret_cast<u16*>(mem(address)); break;
+                case BC_STR: *reinterpret_cast<u32*>(mem(address)) = r[d]; break;
+                default: *mem(address) = r[d]; break;
+                }
+                continue;
+            }
+
+            if(op >= BC_ADDRI && op <= BC_STRBI){
+                u32 d = *pc & 7, n = (*pc++ >> 4) & 7;
+                u32 imm = *pc++;
+                u32 address = r[n] + imm;
+                switch(op){
+                case BC_ADDRI: r[d] = add(r[n], imm, 0); break;
+                case BC_SUBRI: r[d] = sub(r[n], imm, 1); break;
+                case BC_LSLI:
+                    if(imm) c = (r[n] >> (32 - imm)) & 1;
+                    r[d] = nz = r[n] << imm;
+                    break;
+                case BC_LSRI:
+                    if(imm) c = (r[n] >> (imm - 1)) & 1;
+                    r[d] = nz = r[n] >> imm;
+                    break;
+                case BC_ASRI:
+                    if(imm) c = (s32(r[n]) >> (imm - 1)) & 1;
+                    r[d] = nz = s32(r[n]) >> imm;
+                    break;
+                case BC_MODI: r[d] = nz = imm >= 32 ? r[n] : r[n] & ((u32(1) << imm) - 1); break;
+                case BC_LDRI: r[d] = *reinterpret_cast<u32*>(mem(address)); break;
+                case BC_LDRBI: r[d] = *mem(address); break;
+                case BC_LDRHI: r[d] = *reinterpret_cast<u16*>(mem(address)); break;
+                case BC_STRI: *reinterpret_cast<u32*>(mem(address)) = r[d]; break;
+                default: *mem(address) = r[d]; break;
+                }
+                continue;
+            }
+
+            switch(op){
+            case BC_RET:
+                return r[0];
+
+            case BC_ENTER:
+                if(*pc){
+                    sp = static_cast<u32*>(__builtin_alloca(*pc << 2));
+                    for(u32 i=0; i<*pc; ++i)
+                        sp[i] = 0;
+                }
+                pc++;
+                break;
+
+            case BC_LDM:{
+                u32 n = pc[0] & 7, mask = pc[1];
+                pc += 2;
+                u32 address = r[n];
+                for(u32 i=0; i<8; ++i){
+                    if(mask & (1 << i)){
+                        r[i] = *reinterpret_cast<u32*>(mem(address));
+                        address += 4;
+                    }
+                }
+                if(!(mask & (1 << n)))
+                    r[n] = address;
+                break;
+            }
+
+            case BC_CALL:
+                bytecodeCall(pc[0] | (pc[1] << 8) | (pc[2] << 16) | (u32(pc[3]) << 24), r);
+                pc += 4;
+                break;
+
+            case BC_CALLR:
+                bytecodeCall(r[*pc++ & 7], r);
+                break;
+
+            default:
+                LOG("Bad bytecode ", op, "\n");
+                __builtin_trap();
+            }
+        }
+    }
+
+    // Wraps a native code generator. Functions started with
+    // setBytecode(true) are emitted as bytecode into a buffer obtained
+    // from allocate(), behind a short native stub at the address Pine
+    // sees, everything else goes straight to the native backend.
+    template <typename Native, u32 symTableCapacity = 256, u32 fixupCapacity = 256, bool verbose = true>
+    class CodeGenBytecode {
+        using RL = RegLow;
+        using RX = Reg;
+
+        Native& native;
+        u8 *(*allocate)(u32 size);
+        ByteWriter writer{nullptr, 0};
+        const char *error = nullptr;
+        bool bytecode = false;
+        u32 entry = 0;      // stub offset in the native code
+        u32 entryAddress = 0;
+        u32 symCount = 0;
+        u32 fixupCount = 0;
+
+        struct Sym {
+            u32 hash;
+            u32 address;
+        } symTable[symTableCapacity];
+
+        struct Fixup {
+            u32 position;
+            u32 symId;
+        } fixups[fixupCapacity];
+
+        bool begin(const char *name){
+            if(error) return false;
+            if(verbose) LOGD( reinterpret_cast<void*>(uintptr_t(writer.tell(true))), ": BC ", name, "\n" );
+            if(writer.full()){
+                error = "Bytecode Full";
+                return false;
+            }
+            return true;
+        }
+
+        static u32 r(RegLow reg){
+            return reg.value & 7;
+        }
+
+        void op(u32 code){
+            writer << u8(code);
+        }
+
+        void op(u32 code, u32 a){
+            writer << u8(code) << u8(a);
+        }
+
+        void op(u32 code, u32 a, u32 b){
+            writer << u8(code) << u8(a) << u8(b);
+        }
+
+        void op2(Bytecode code, RL d, RL m){
+            if(!begin("op2")) return;
+            op(code, r(d) | (r(m) << 4));
+        }
+
+        void op3(Bytecode code, RL d, RL n, RL m){
+            if(!begin("op3")) return;
+            op(code, r(d) | (r(n) << 4), r(m));
+        }
+
+        void opImm(Bytecode code, RL d, RL n, u32 imm){
+            if(!begin("opImm")) return;
+            op(code, r(d) | (r(n) << 4), imm);
+        }
+
+        u32 symRef(Label lbl){
+            for(u32 i=0; i<symCount; ++i){
+                if(symTable[i].hash == lbl.value)
+                    return i;
+            }
+            if(symCount == symTableCapacity){
+                error = "opmax";
+                return 0;
+            }
+            symTable[symCount] = { lbl.value, ~u32{} };
+            return symCount++;
+        }
+
+        void branch(u32 cond, Label lbl){
+            if(!begin("B")) return;
+            if(fixupCount == fixupCapacity){
+                error = "opmax";
+                return;
+            }
+            op(BC_B + cond);
+            fixups[fixupCount++] = { writer.tell(), symRef(lbl) };
+            writer << u16(0);
+        }
+
+        void load(RL rt, u32 imm){
+            if(!begin("LDR")) return;
+            op(BC_LDR32 + r(rt));
+            writer << u32(imm);
+        }
+
+    public:
+        static constexpr u32 thumbBit = Native::thumbBit;
+        static constexpr bool hasBytecode = true;
+        static constexpr bool hasLinkRegister = Native::hasLinkRegister;
+
+        // Pine seeks within the current function to patch its prologue
+        class Writer {
+            CodeGenBytecode& cg;
+        public:
+            Writer(CodeGenBytecode& cg) : cg(cg) {}
+
+            u32 tell(){
+                return cg.bytecode ? cg.writer.tell() : cg.native.getWriter().tell();
+            }
+
+            void seek(u32 pos){
+                if(cg.bytecode) cg.writer.seek(pos);
+                else cg.native.getWriter().seek(pos);
+            }
+        } proxy{*this};
+
+        CodeGenBytecode(Native& native, u8 *(*allocate)(u32 size)) : native(native), allocate(allocate) {}
+
+        operator bool () {
+            return !error && native;
+        }
+
+        const char *getError(){
+            return error ?: native.getError();
+        }
+
+        Writer& getWriter(){ return proxy; }
+
+        // Address Pine gives the current function: its stub in bytecode mode
+        u32 tell(){
+            return bytecode ? entry : native.tell();
+        }
+
+        bool isBytecode(){
+            return bytecode;
+        }
+
+        // Bytecode functions always keep their frame
+        bool isLeaf(){
+            return !bytecode && native.isLeaf();
+        }
+
+        u32 writtenMap(){
+            return native.writtenMap();
+        }
+
+        void truncate(u32 pos){
+            native.truncate(pos);
+        }
+
+        void STUB(u32 handler, u32 context){
+            native.STUB(handler, context);
+        }
+
+        u32 bytecodeSize(){
+            return writer.tell(true);
+        }
+
+        void setBytecode(bool enabled, u32 capacity = 0x1000){
+            bytecode = false;
+            if(!enabled || error)
+                return;
+            if(!writer.getBuffer()){
+                auto buffer = allocate(capacity);
+                if(!buffer){
+                    error = "Out of bytecode memory";
+                    return;
+                }
+                writer = ByteWriter(buffer, capacity);
+            }
+            entry = native.tell();
+            entryAddress = u32(uintptr_t(native.getWriter().getBuffer())) + entry + thumbBit;
+            native.STUB(u32(uintptr_t(runBytecode)), u32(uintptr_t(writer.getBuffer() + writer.tell(true))));
+            native.link();
+            bytecode = true;
+        }
+
+        void link(){
+            if(!bytecode){
+                native.link();
+                return;
+            }
+            if(error){
+                LOG(error, "\n");
+                return;
+            }
+            u32 end = writer.tell();
+            for(u32 i = 0; i < fixupCount; ++i){
+                u32 address = symTable[fixups[i].symId].address;
+                if( address == ~u32{} ){
+                    error = "Unresolved Symbol";
+                    return;
+                }
+                writer.seek(fixups[i].position);
+                writer << u16(address - (fixups[i].position + 2));
+            }
+            writer.seek(end);
+            writer.newChunk();
+            symCount = 0;
+            fixupCount = 0;
+        }
+
+        void label(Label lbl){
+            if(!bytecode){
+                native.label(lbl);
+                return;
+            }
+            u32 symId = symRef(lbl);
+            if(symTable[symId].address != ~u32{}){
+                error = "Symbol redeclared";
+                return;
+            }
+            symTable[symId].address = writer.tell();
+        }
+
+        CodeGenBytecode& operator [] (Label lbl){
+            label(lbl);
+            return *this;
+        }
+
+        void POOL(){
+            if(!bytecode) native.POOL();
+        }
+
+        void ADCS(RL rdn, RL rm){
+            if(!bytecode) return native.ADCS(rdn, rm);
+            op2(BC_ADCS, rdn, rm);
+        }
+
+        void ADDS(RL rd, RL rn, I3 i){
+            if(!bytecode) return native.ADDS(rd, rn, i);
+            if(r(rd) == r(rn)) return ADDS(rd, I8(i));
+            opImm(BC_ADDRI, rd, rn, i.value);
+        }
+
+        void ADDS(RL rdn, I8 i){
+            if(!bytecode) return native.ADDS(rdn, i);
+            if(!begin("ADDS")) return;
+            op(BC_ADDI + r(rdn), i.value);
+        }
+
+        void ADDS(RL rd, RL rn, RL rm){
+            if(!bytecode) return native.ADDS(rd, rn, rm);
+            if(r(rd) == r(rn)) return op2(BC_ADDS, rd, rm);
+            op3(BC_ADD3, rd, rn, rm);
+        }
+
+        void ADDS(RL rnd, RL rm){
+            ADDS(rnd, rnd, rm);
+        }
+
+        void ADD(SP_t sp, u32 imm){
+            if(!bytecode) return native.ADD(sp, imm);
+            // slots are released by BC_RET
+        }
+
+        void ANDS(RL rdn, RL rm){
+            if(!bytecode) return native.ANDS(rdn, rm);
+            op2(BC_ANDS, rdn, rm);
+        }
+
+        void ASRS(RL rd, RL rm, Imm<5, 0> imm){
+            if(!bytecode) return native.ASRS(rd, rm, imm);
+            opImm(BC_ASRI, rd, rm, imm.value);
+        }
+
+        void ASRS(RL rd, I8 imm){
+            ASRS(rd, rd, imm.value);
+        }
+
+        void ASRS(RL rdn, RL rm){
+            if(!bytecode) return native.ASRS(rdn, rm);
+            op2(BC_ASRS, rdn, rm);
+        }
+
+        void B(ConditionCode cc, Label label){
+            if(!bytecode) return native.B(cc, label);
+            branch(cc, label);
+        }
+
+        void B(Label label){
+            if(!bytecode) return native.B(label);
+            branch(14, label);
+        }
+
+        void BKPT(I8 i){
+            if(!bytecode) return native.BKPT(i);
+            if(begin("BKPT")) op(BC_BKPT);
+        }
+
+        // address is relative to the function, as Pine sees it
+        void BL(u32 address){
+            if(!bytecode) return native.BL(address);
+            if(!begin("CALL")) return;
+            op(BC_CALL);
+            writer << u32(entryAddress + address);
+        }
+
+        void BLX(RL rm){
+            if(!bytecode) return native.BLX(rm);
+            if(begin("CALLR")) op(BC_CALLR, r(rm));
+        }
+
+        // Only used by native leaf functions
+        void BX(RX rm){
+            if(!bytecode) return native.BX(rm);
+            error = "BX in bytecode";
+        }
+
+        void CMP(RL rn, I8 imm){
+            if(!bytecode) return native.CMP(rn, imm);
+            if(begin("CMP")) op(BC_CMPI + r(rn), imm.value);
+        }
+
+        void CMP(RL rn, RL rm){
+            if(!bytecode) return native.CMP(rn, rm);
+            op2(BC_CMP, rn, rm);
+        }
+
+        void EORS(RL rdn, RL rm){
+            if(!bytecode) return native.EORS(rdn, rm);
+            op2(BC_EORS, rdn, rm);
+        }
+
+        template<typename ... Args>
+        void LDM(RL rn, Args ... rl){
+            if(!bytecode) return native.LDM(rn, rl...);
+            if(begin("LDM")) op(BC_LDM, r(rn), (0 | ... | (1 << r(rl))));
+        }
+
+        bool tryLDRS(RL rt, u32 imm){
+            if(!bytecode) return native.tryLDRS(rt, imm);
+            if(imm & ~0xFF)
+                return false;
+            MOVS(rt, imm);
+            return true;
+        }
+
+        void LDR(RL rt, u32 imm){
+            if(!bytecode) return native.LDR(rt, imm);
+            load(rt, imm);
+        }
+
+        void LDRS(RL rt, u32 imm){
+            if(!bytecode) return native.LDRS(rt, imm);
+            if(tryLDRS(rt, imm))
+                return;
+            load(rt, imm);
+            CMP(rt, 0);
+        }
+
+        void LDRI(RL rt, u32 imm, bool preserveStatus = false){
+            if(!bytecode) return native.LDRI(rt, imm, preserveStatus);
+            if(!preserveStatus && tryLDRS(rt, imm))
+                return;
+            load(rt, imm);
+        }
+
+        void LDR(RL rt, RL rn, Imm<5, 2> imm = 0){
+            if(!bytecode) return native.LDR(rt, rn, imm);
+            opImm(BC_LDRI, rt, rn, imm.value << 2);
+        }
+
+        void LDR(RL rt, SP_t sp, u32 offset){
+            if(!bytecode) return native.LDR(rt, sp, offset);
+            if(begin("LDR")) op(BC_LDRSP + r(rt), offset >> 2);
+        }
+
+        void LDR(RL rt, RL rn, RL rm){
+            if(!bytecode) return native.LDR(rt, rn, rm);
+            op3(BC_LDR, rt, rn, rm);
+        }
+
+        void LDRB(RL rt, RL rn, Imm<5, 0> imm){
+            if(!bytecode) return native.LDRB(rt, rn, imm);
+            opImm(BC_LDRBI, rt, rn, imm.value);
+        }
+
+        void LDRB(RL rt, RL rn, RL rm){
+            if(!bytecode) return native.LDRB(rt, rn, rm);
+            op3(BC_LDRB, rt, rn, rm);
+        }
+
+        void LDRH(RL rt, RL rn, Imm<5, 1> imm){
+            if(!bytecode) return native.LDRH(rt, rn, imm);
+            opImm(BC_LDRHI, rt, rn, imm.value << 1);
+        }
+
+        void LDRH(RL rt, RL rn, RL rm){
+            if(!bytecode) return native.LDRH(rt, rn, rm);
+            op3(BC_LDRH, rt, rn, rm);
+        }
+
+        void MODS(RL rd, I8 imm){
+            if(!bytecode) return native.MODS(rd, imm);
+            opImm(BC_MODI, rd, rd, imm.value);
+        }
+
+        void LSLS(RL rd, RL rm, Imm<5, 0> imm){
+            if(!bytecode) return native.LSLS(rd, rm, imm);
+            opImm(BC_LSLI, rd, rm, imm.value);
+        }
+
+        void LSLS(RL rd, I8 imm){
+            LSLS(rd, rd, imm.value);
+        }
+
+        void LSLS(RL rdn, RL rm){
+            if(!bytecode) return native.LSLS(rdn, rm);
+            op2(BC_LSLS, rdn, rm);
+        }
+
+        void LSRS(RL rd, RL rm, Imm<5, 0> imm){
+            if(!bytecode) return native.LSRS(rd, rm, imm);
+            opImm(BC_LSRI, rd, rm, imm.value);
+        }
+
+        void LSRS(RL rd, I8 imm){
+            LSRS(rd, rd, imm.value);
+        }
+
+        void LSRS(RL rdn, RL rm){
+            if(!bytecode) return native.LSRS(rdn, rm);
+            op2(BC_LSRS, rdn, rm);
+        }
+
+        void MOV(RX rd, RX rm){
+            if(!bytecode) return native.MOV(rd, rm);
+            if(rd.value > 7 || rm.value > 7){
+                error = "MOV in bytecode";
+                return;
+            }
+            op2(BC_MOV, RL(rd.value), RL(rm.value));
+        }
+
+        void MOVS(RL rd, I8 imm){
+            if(!bytecode) return native.MOVS(rd, imm);
+            if(begin("MOVS")) op(BC_MOVI + r(rd), imm.value);
+        }
+
+        void MOVS(RL rd, RL rm){
+            if(!bytecode) return native.MOVS(rd, rm);
+            op2(BC_MOVS, rd, rm);
+        }
+
+        void MULS(RL rdm, RL rn){
+            if(!bytecode) return native.MULS(rdm, rn);
+            op2(BC_MULS, rdm, rn);
+        }
+
+        void MVNS(RL rd, RL rm){
+            if(!bytecode) return native.MVNS(rd, rm);
+            op2(BC_MVNS, rd, rm);
+        }
+
+        // Same size as SUB(SP, ...)
+        void NOP(){
+            if(!bytecode) return native.NOP();
+            if(begin("NOP")) op(BC_ENTER, 0);
+        }
+
+        void ORRS(RL rdn, RL rm){
+            if(!bytecode) return native.ORRS(rdn, rm);
+            op2(BC_ORRS, rdn, rm);
+        }
+
+        // The interpreter keeps its own registers, nothing to save
+        void PUSH(u32 map){
+            if(!bytecode) native.PUSH(map);
+        }
+
+        template<typename ... Arg>
+        void PUSH(Arg ... arg){
+            if(!bytecode) native.PUSH(arg...);
+        }
+
+        void POP(u32 map){
+            if(!bytecode) return native.POP(map);
+            if(begin("RET")) op(BC_RET);
+        }
+
+        void RSBS(RL rd, RL rn){
+            if(!bytecode) return native.RSBS(rd, rn);
+            op2(BC_RSBS, rd, rn);
+        }
+
+        void SBCS(RL rdn, RL rm){
+            if(!bytecode) return native.SBCS(rdn, rm);
+            op2(BC_SBCS, rdn, rm);
+        }
+
+        void STR(RL rt, RL rn, Imm<5, 2> imm = 0){
+            if(!bytecode) return native.STR(rt, rn, imm);
+            opImm(BC_STRI, rt, rn, imm.value << 2);
+        }
+
+        void STR(RL rt, SP_t sp, u32 offset){
+            if(!bytecode) return native.STR(rt, sp, offset);
+            if(begin("STR")) op(BC_STRSP + r(rt), offset >> 2);
+        }
+
+        void STR(RL rt, RL rn, RL rm){
+            if(!bytecode) return native.STR(rt, rn, rm);
+            op3(BC_STR, rt, rn, rm);
+        }
+
+        void STRB(RL rt, RL rn, Imm<5, 0> imm){
+            if(!bytecode) return native.STRB(rt, rn, imm);
+            opImm(BC_STRBI, rt, rn, imm.value);
+        }
+
+        void STRB(RL rt, RL rn, RL rm){
+            if(!bytecode) return native.STRB(rt, rn, rm);
+            op3(BC_STRB, rt, rn, rm);
+        }
+
+        void SUBS(RL rd, RL rn, I3 imm){
+            if(!bytecode) return native.SUBS(rd, rn, imm);
+            if(r(rd) == r(rn)) return SUBS(rd, I8(imm));
+            opImm(BC_SUBRI, rd, rn, imm.value);
+        }
+
+        void SUBS(RL rdn, I8 imm){
+            if(!bytecode) return native.SUBS(rdn, imm);
+            if(begin("SUBS")) op(BC_SUBI + r(rdn), imm.value);
+        }
+
+        void SUBS(RL rd, RL rn, RL rm){
+            if(!bytecode) return native.SUBS(rd, rn, rm);
+            if(r(rd) == r(rn)) return op2(BC_SUBS, rd, rm);
+            op3(BC_SUB3, rd, rn, rm);
+        }
+
+        void SUBS(RL rnd, RL rm){
+            SUBS(rnd, rnd, rm);
+        }
+
+        void SUB(SP_t sp, u32 imm){
+            if(!bytecode) return native.SUB(sp, imm);
+            if(begin("ENTER")) op(BC_ENTER, imm >> 2);
+        }
+    };
+
+}
@@ -0,0 +1,662 @@
+#pragma once
+
+#include "codegen.h"
+
+namespace cg {
+
+    // Emits x86-64 code with the same interface as the Thumb CodeGen, so
+    // Pine can be instantiated with either. The eight low registers map to
+    // the System V argument registers (r0-r3) and to callee saved ones
+    // (r4-r7). Calls return in eax, which is copied back into r0 and, for
+    // the runtime's {quotient, remainder} helpers, its upper half into r1.
+    // Values are 32 bits wide, so code, data and native functions all have
+    // to live below 4GB.
+    template <typename CodeWriter, u32 symTableCapacity = 256, u32 fixupCapacity = 512, bool verbose = true>
+    class CodeGenX64 {
+        CodeWriter& writer;
+        const char *error = nullptr;
+        u32 symCount = 0;
+        u32 fixupCount = 0;
+
+        // Thumb sets carry to "no borrow" after a subtraction, x86 to
+        // "borrow". Remembered so ADCS/SBCS can flip it when needed.
+        bool subCarry = false;
+
+        struct Sym {
+            u32 hash;
+            u32 address;
+        } symTable[symTableCapacity];
+
+        struct Fixup {
+            u32 position; // of the rel32 field
+            u32 symId;
+        } fixups[fixupCapacity];
+
+        static constexpr u8 RAX = 0, RCX = 1, RSP = 4, R11 = 11;
+        static constexpr u8 regs[8] = {7, 6, 2, 1, 3, 12, 13, 14}; // rdi rsi rdx rcx rbx r12 r13 r14
+
+        static constexpr u8 cond[14] = {
+            0x4, 0x5,       // EQ NE
+            0x3, 0x2,       // CS CC, as left by a subtraction
+            0x8, 0x9,       // MI PL
+            0x0, 0x1,       // VS VC
+            0x7, 0x6,       // HI LS
+            0xD, 0xC,       // GE LT
+            0xF, 0xE        // GT LE
+        };
+
+        static u8 x(RegLow r){
+            return regs[r.value & 7];
+        }
+
+        bool begin(const char *name){
+            if(error) return false;
+            if(verbose) LOGD( reinterpret_cast<void*>(uintptr_t(writer.tell(true))), ": ", name, "\n" );
+            if(writer.full()){
+                error = "Writer Full";
+                return false;
+            }
+            return true;
+        }
+
+        void byte(u32 b){
+            writer << u8(b);
+        }
+
+        void rex(bool w, u32 reg, u32 index, u32 base, bool force = false){
+            u32 r = 0x40 | (w << 3) | ((reg >> 3) << 2) | ((index >> 3) << 1) | (base >> 3);
+            if(r != 0x40 || force)
+                byte(r);
+        }
+
+        void opcode(u32 op){
+            if(op > 0xFF)
+                byte(op >> 8);
+            byte(op);
+        }
+
+        // op reg, rm (register direct)
+        void rr(u32 op, u32 reg, u32 rm, bool w = false){
+            rex(w, reg, 0, rm);
+            opcode(op);
+            byte(0xC0 | ((reg & 7) << 3) | (rm & 7));
+        }
+
+        // op reg, [base + disp]
+        void mem(u32 op, u32 reg, u32 base, s32 disp, bool byteReg = false){
+            rex(false, reg, 0, base, byteReg && (reg & 7) >= 4);
+            opcode(op);
+            u32 mod = (disp == 0 && (base & 7) != 5) ? 0 : (disp >= -128 && disp < 128) ? 1 : 2;
+            byte((mod << 6) | ((reg & 7) << 3) | (base & 7));
+            if((base & 7) == 4)
+                byte(0x24);
+            if(mod == 1) byte(disp);
+            else if(mod == 2) writer << u32(disp);
+        }
+
+        // op reg, [base + index], added in 32 bits so negative offsets
+        // wrap around like they do on the device
+        void memIndex(u32 op, u32 reg, u32 base, u32 index, bool byteReg = false){
+            byte(0x67);
+            rex(false, reg, index, base, byteReg && (reg & 7) >= 4);
+            opcode(op);
+            u32 mod = (base & 7) == 5 ? 1 : 0;
+            byte((mod << 6) | ((reg & 7) << 3) | 4);
+            byte(((index & 7) << 3) | (base & 7));
+            if(mod) byte(0);
+        }
+
+        void aluImm(u32 ext, u32 r, u32 imm, bool w = false){
+            rex(w, 0, 0, r);
+            if(s32(imm) >= -128 && s32(imm) < 128){
+                byte(0x83);
+                byte(0xC0 | (ext << 3) | (r & 7));
+                byte(imm);
+            }else{
+                byte(0x81);
+                byte(0xC0 | (ext << 3) | (r & 7));
+                writer << u32(imm);
+            }
+        }
+
+        void mov(u32 rd, u32 rm){
+            if(rd != rm)
+                rr(0x89, rm, rd);
+        }
+
+        void movImm(u32 rd, u32 imm){
+            rex(false, 0, 0, rd);
+            byte(0xB8 | (rd & 7));
+            writer << u32(imm);
+        }
+
+        void test(u32 r){
+            rr(0x85, r, r);
+        }
+
+        // op rd, rm for the two operand ALU forms (add, sub, and, or, xor...)
+        void alu(u32 op, RegLow rd, RegLow rn, RegLow rm){
+            u32 d = x(rd), n = x(rn), m = x(rm);
+            if(d == n){
+                rr(op, m, d);
+            }else if(d == m && (op == 0x01 || op == 0x21 || op == 0x09 || op == 0x31)){
+                rr(op, n, d);
+            }else if(d == m){
+                mov(RAX, n);
+                rr(op, m, RAX);
+                mov(d, RAX);
+            }else{
+                mov(d, n);
+                rr(op, m, d);
+            }
+        }
+
+        void shiftImm(u32 ext, RegLow rd, RegLow rm, u32 imm){
+            u32 d = x(rd);
+            mov(d, x(rm));
+            if(!imm){
+                test(d);
+                return;
+            }
+            rex(false, 0, 0, d);
+            byte(0xC1);
+            byte(0xC0 | (ext << 3) | (d & 7));
+            byte(imm);
+            subCarry = false;
+        }
+
+        // x86 only shifts by cl, which is r3
+        void shiftReg(u32 ext, RegLow rdn, RegLow rm){
+            u32 d = x(rdn), m = x(rm);
+            u32 target = d;
+            if(m != RCX){
+                mov(R11, RCX);
+                mov(RCX, m);
+                if(d == RCX) target = R11;
+            }
+            rex(false, 0, 0, target);
+            byte(0xD3);
+            byte(0xC0 | (ext << 3) | (target & 7));
+            test(target);
+            if(m != RCX)
+                mov(RCX, R11);
+            subCarry = false;
+        }
+
+        u32 symRef(Label lbl){
+            for(u32 i=0; i<symCount; ++i){
+                if(symTable[i].hash == lbl.value)
+                    return i;
+            }
+            if(symCount == symTableCapacity){
+                error = "opmax";
+                return 0;
+            }
+            symTable[symCount] = { lbl.value, ~u32{} };
+            return symCount++;
+        }
+
+        void jump(Label lbl){
+            u32 symId = symRef(lbl);
+            if(fixupCount == fixupCapacity){
+                error = "opmax";
+                return;
+            }
+            fixups[fixupCount++] = { writer.tell(), symId };
+            writer << u32(0);
+        }
+
+        void afterCall(){
+            mov(regs[0], RAX);   // mov edi, eax
+            rr(0x89, RAX, regs[1], true); // mov rsi, rax
+            rex(true, 0, 0, regs[1]);
+            byte(0xC1);
+            byte(0xE8 | (regs[1] & 7)); // shr rsi, 32
+            byte(32);
+            subCarry = false;
+        }
+
+        static u32 frameSize(u32 bytes){
+            return (bytes + 15) & ~u32{15};
+        }
+
+    public:
+        static constexpr u32 thumbBit = 0;
+        static constexpr bool hasBytecode = false;
+        static constexpr bool hasLinkRegister = false;
+
+        CodeGenX64(CodeWriter& writer) : writer(writer) {}
+
+        operator bool () {
+            return !error;
+        }
+
+        const char *getError(){
+            return error;
+        }
+
+        CodeWriter& getWriter(){ return writer; }
+
+        u32 tell(){
+            return writer.tell(true);
+        }
+
+        // Discards the code from pos on. Only valid right after link().
+        void truncate(u32 pos){
+            writer.seek(pos, true);
+            writer.newChunk();
+        }
+
+        void link(){
+            if(error){
+                LOG(error, "\n");
+                while(true);
+                return;
+            }
+            LOGD("Linking\n");
+            u32 end = writer.tell();
+            for(u32 i = 0; i < fixupCount; ++i){
+                u32 address = symTable[fixups[i].symId].address;
+                if( address == ~u32{} ){
+                    error = "Unresolved Symbol";
+                    return;
+                }
+                writer.seek(fixups[i].position);
+                writer << u32(address - (fixups[i].position + 4));
+            }
+            writer.seek(end);
+            writer.newChunk();
+            symCount = 0;
+            fixupCount = 0;
+        }
+
+        using RL = RegLow;
+        using RX = Reg;
+
+        void label(Label lbl) {
+            u32 symId = symRef(lbl);
+            if(symTable[symId].address != ~u32{}){
+                error = "Symbol redeclared";
+                return;
+            }
+            symTable[symId].address = writer.tell();
+        }
+
+        CodeGenX64& operator [] (Label lbl){
+            label(lbl);
+            return *this;
+        }
+
+        // Constants are immediates here, there is nothing to pool.
+        void POOL(){}
+
+        void ADCS(RL rdn, RL rm){
+            if(!begin("ADCS")) return;
+            if(subCarry) byte(0xF5); // cmc
+            rr(0x11, x(rm), x(rdn));
+            subCarry = false;
+        }
+
+        void ADDS(RL rd, RL rn, I3 i){
+            if(!begin("ADDS")) return;
+            mov(x(rd), x(rn));
+            aluImm(0, x(rd), i.value);
+            subCarry = false;
+        }
+
+        void ADDS(RL rdn, I8 i){
+            if(!begin("ADDS")) return;
+            aluImm(0, x(rdn), i.value);
+            subCarry = false;
+        }
+
+        void ADDS(RL rd, RL rn, RL rm){
+            if(!begin("ADDS")) return;
+            alu(0x01, rd, rn, rm);
+            subCarry = false;
+        }
+
+        void ADDS(RL rnd, RL rm){
+            ADDS(rnd, rnd, rm);
+        }
+
+        void ADD(SP_t, u32 imm){
+            if(!begin("ADD")) return;
+            aluImm(0, RSP, frameSize(imm), true);
+        }
+
+        void ANDS(RL rdn, RL rm){
+            if(!begin("ANDS")) return;
+            rr(0x21, x(rm), x(rdn));
+        }
+
+        void ASRS(RL rd, RL rm, Imm<5, 0> imm){
+            if(!begin("ASRS")) return;
+            shiftImm(7, rd, rm, imm.value);
+        }
+
+        void ASRS(RL rd, I8 imm){
+            ASRS(rd, rd, imm.value);
+        }
+
+        void ASRS(RL rdn, RL rm){
+            if(!begin("ASRS")) return;
+            shiftReg(7, rdn, rm);
+        }
+
+        void B(ConditionCode cc, Label label){
+            if(!begin("B")) return;
+            byte(0x0F);
+            byte(0x80 | cond[cc]);
+            jump(label);
+        }
+
+        void B(Label label){
+            if(!begin("B")) return;
+            byte(0xE9);
+            jump(label);
+        }
+
+        void BKPT(I8){
+            if(!begin("BKPT")) return;
+            byte(0xCC);
+        }
+
+        // address is relative to the start of the current chunk
+        void BL(u32 address){
+            if(!begin("BL")) return;
+            byte(0xE8);
+            writer << u32(address - (writer.tell() + 4));
+            afterCall();
+        }
+
+        void BLX(RL rm){
+            if(!begin("BLX")) return;
+            rex(false, 0, 0, x(rm));
+            byte(0xFF);
+            byte(0xD0 | (x(rm) & 7));
+            afterCall();
+        }
+
+        void CMP(RL rn, I8 imm){
+            if(!begin("CMP")) return;
+            aluImm(7, x(rn), imm.value);
+            subCarry = true;
+        }
+
+        void CMP(RL rn, RL rm){
+            if(!begin("CMP")) return;
+            rr(0x39, x(rm), x(rn));
+            subCarry = true;
+        }
+
+        void EORS(RL rdn, RL rm){
+            if(!begin("EORS")) return;
+            rr(0x31, x(rm), x(rdn));
+        }
+
+        template<typename ... Args>
+        void LDM(RL rn, Args ... rl){
+            if(!begin("LDM")) return;
+            s32 disp = 0;
+            ((mem(0x8B, x(rl), x(rn), disp), disp += 4), ...);
+            mem(0x8D, x(rn), x(rn), disp); // lea leaves the flags alone
+        }
+
+        bool tryLDRS(RL rt, u32 imm){
+            LDRS(rt, imm);
+            return true;
+        }
+
+        void LDR(RL rt, u32 imm){
+            if(!begin("LDR")) return;
+            movImm(x(rt), imm);
+        }
+
+        void LDRS(RL rt, u32 imm){
+            if(!begin("LDRS")) return;
+            movImm(x(rt), imm);
+            test(x(rt));
+        }
+
+        // mov leaves the flags alone, so there is no status to preserve
+        void LDRI(RL rt, u32 imm, bool = false){
+            LDR(rt, imm);
+        }
+
+        void LDR(RL rt, RL rn, Imm<5, 2> imm = 0){
+            if(!begin("LDR")) return;
+            mem(0x8B, x(rt), x(rn), imm.value << 2);
+        }
+
+        void LDR(RL rt, SP_t, u32 offset){
+            if(!begin("LDR")) return;
+            mem(0x8B, x(rt), RSP, offset);
+        }
+
+        void LDR(RL rt, RL rn, RL rm){
+            if(!begin("LDR")) return;
+            memIndex(0x8B, x(rt), x(rn), x(rm));
+        }
+
+        void LDRB(RL rt, RL rn, Imm<5, 0> imm){
+            if(!begin("LDRB")) return;
+            mem(0x0FB6, x(rt), x(rn), imm.value);
+        }
+
+        void LDRB(RL rt, RL rn, RL rm){
+            if(!begin("LDRB")) return;
+            memIndex(0x0FB6, x(rt), x(rn), x(rm));
+        }
+
+        void LDRH(RL rt, RL rn, Imm<5, 1> imm){
+            if(!begin("LDRH")) return;
+            mem(0x0FB7, x(rt), x(rn), imm.value << 1);
+        }
+
+        void LDRH(RL rt, RL rn, RL rm){
+            if(!begin("LDRH")) return;
+            memIndex(0x0FB7, x(rt), x(rn), x(rm));
+        }
+
+        void MODS(RL rd, I8 imm){
+            if(!begin("MODS")) return;
+            aluImm(4, x(rd), imm.value >= 32 ? ~u32{} : (u32(1) << imm.value) - 1);
+        }
+
+        void LSLS(RL rd, RL rm, Imm<5, 0> imm){
+            if(!begin("LSLS")) return;
+            shiftImm(4, rd, rm, imm.value);
+        }
+
+        void LSLS(RL rd, I8 imm){
+            LSLS(rd, rd, imm.value);
+        }
+
+        void LSLS(RL rdn, RL rm){
+            if(!begin("LSLS")) return;
+            shiftReg(4, rdn, rm);
+        }
+
+        void LSRS(RL rd, RL rm, Imm<5, 0> imm){
+            if(!begin("LSRS")) return;
+            shiftImm(5, rd, rm, imm.value);
+        }
+
+        void LSRS(RL rd, I8 imm){
+            LSRS(rd, rd, imm.value);
+        }
+
+        void LSRS(RL rdn, RL rm){
+            if(!begin("LSRS")) return;
+            shiftReg(5, rdn, rm);
+        }
+
+        void MOVS(RL rd, I8 imm){
+            if(!begin("MOVS")) return;
+            movImm(x(rd), imm.value);
+            test(x(rd));
+        }
+
+        void MOVS(RL rd, RL rm){
+            if(!begin("MOVS")) return;
+            mov(x(rd), x(rm));
+            test(x(rd));
+        }
+
+        // Low registers only, leaves the flags alone
+        void MOV(RX rd, RX rm){
+            if(!begin("MOV")) return;
+            if(rd.value > 7 || rm.value > 7){
+                error = "MOV high register";
+                return;
+            }
+            mov(x(RL(rd.value)), x(RL(rm.value)));
+        }
+
+        void MULS(RL rdm, RL rn){
+            if(!begin("MULS")) return;
+            rr(0x0FAF, x(rdm), x(rn));
+            test(x(rdm));
+        }
+
+        void MVNS(RL rd, RL rm){
+            if(!begin("MVNS")) return;
+            mov(x(rd), x(rm));
+            rex(false, 0, 0, x(rd));
+            byte(0xF7);
+            byte(0xD0 | (x(rd) & 7));
+            test(x(rd));
+        }
+
+        // Same size as SUB(SP, ...), so the prologue can be patched in place
+        void NOP(){
+            if(!begin("NOP")) return;
+            byte(0x0F); byte(0x1F); byte(0x80);
+            writer << u32(0);
+        }
+
+        void ORRS(RL rdn, RL rm){
+            if(!begin("ORRS")) return;
+            rr(0x09, x(rm), x(rdn));
+        }
+
+        // Always saves every callee saved register PINE uses, plus a pad
+        // to keep the stack 16 byte aligned. The return address is
+        // already on the stack.
+        void PUSH(u32){
+            if(!begin("PUSH")) return;
+            byte(0x53);             // push rbx
+            byte(0x41); byte(0x54); // push r12
+            byte(0x41); byte(0x55); // push r13
+            byte(0x41); byte(0x56); // push r14
+            byte(0x50);             // push rax
+        }
+
+        // Saves rbx and r12-r14 whatever registers the list names
+        template<typename ... Arg>
+        void PUSH(Arg ...){
+            PUSH(u32(0));
+        }
+
+        void POP(u32 map){
+            if(!begin("POP")) return;
+            byte(0x41); byte(0x5B); // pop r11
+            byte(0x41); byte(0x5E); // pop r14
+            byte(0x41); byte(0x5D); // pop r13
+            byte(0x41); byte(0x5C); // pop r12
+            byte(0x5B);             // pop rbx
+            if(map & 0x100){
+                mov(RAX, regs[0]);
+                byte(0xC3);
+            }
+        }
+
+        void RSBS(RL rd, RL rn){
+            if(!begin("RSBS")) return;
+            mov(x(rd), x(rn));
+            rex(false, 0, 0, x(rd));
+            byte(0xF7);
+            byte(0xD8 | (x(rd) & 7)); // neg
+            subCarry = true;
+        }
+
+        void SBCS(RL rdn, RL rm){
+            if(!begin("SBCS")) return;
+            if(!subCarry) byte(0xF5); // cmc
+            rr(0x19, x(rm), x(rdn));
+            subCarry = true;
+        }
+
+        void STR(RL rt, RL rn, Imm<5, 2> imm = 0){
+            if(!begin("STR")) return;
+            mem(0x89, x(rt), x(rn), imm.value << 2);
+        }
+
+        void STR(RL rt, SP_t, u32 offset){
+            if(!begin("STR")) return;
+            mem(0x89, x(rt), RSP, offset);
+        }
+
+        void STR(RL rt, RL rn, RL rm){
+            if(!begin("STR")) return;
+            memIndex(0x89, x(rt), x(rn), x(rm));
+        }
+
+        void STRB(RL rt, RL rn, Imm<5, 0> imm){
+            if(!begin("STRB")) return;
+            mem(0x88, x(rt), x(rn), imm.value, true);
+        }
+
+        void STRB(RL rt, RL rn, RL rm){
+            if(!begin("STRB")) return;
+            memIndex(0x88, x(rt), x(rn), x(rm), true);
+        }
+
+        void SUBS(RL rd, RL rn, I3 imm){
+            if(!begin("SUBS")) return;
+            mov(x(rd), x(rn));
+            aluImm(5, x(rd), imm.value);
+            subCarry = true;
+        }
+
+        void SUBS(RL rdn, I8 imm){
+            if(!begin("SUBS")) return;
+            aluImm(5, x(rdn), imm.value);
+            subCarry = true;
+        }
+
+        void SUBS(RL rd, RL rn, RL rm){
+            if(!begin("SUBS")) return;
+            alu(0x29, rd, rn, rm);
+            subCarry = true;
+        }
+
+        void SUBS(RL rnd, RL rm){
+            SUBS(rnd, rnd, rm);
+        }
+
+        // Entry point that calls handler(context, r0-r7) and returns its r0
+        void STUB(u32 handler, u32 context){
+            if(!begin("STUB")) return;
+            aluImm(5, RSP, 40, true);
+            for(u32 i=0; i<8; ++i)
+                mem(0x89, regs[i], RSP, i * 4);
+            movImm(regs[0], context);
+            rr(0x89, RSP, regs[1], true); // mov rsi, rsp
+            movImm(RAX, handler);
+            byte(0xFF); byte(0xD0);       // call rax
+            aluImm(0, RSP, 40, true);
+            byte(0xC3);
+        }
+
+        void SUB(SP_t, u32 imm){
+            if(!begin("SUB")) return;
+            rex(true, 0, 0, RSP);
+            byte(0x81);
+            byte(0xEC);
+            writer << u32(frameSize(imm));
+        }
+    };
+
+}
@@ -5,15 +5,32 @@
 
 #include "infinitearray.h"
 #include "ResTable.h"
+#include "MemoryMap.h"
 
 extern "C" {
     struct _div {int n, d; };
+#ifdef POKITTO
     _div __aeabi_idiv(int, int);
     _div __aeabi_uidivmod(int, int);
+#else
+    // The device gets these from libgcc
+    inline _div __aeabi_idiv(int n, int d){
+        if(!d) return {0, n};
+        return {n / d, n % d};
+    }
+
+    inline _div __aeabi_uidivmod(int n, int d){
+        if(!d) return {0, n};
+        return {int(unsigned(n) / unsigned(d)), int(unsigned(n) % unsigned(d))};
+    }
+#endif
 }
 
 namespace pine {
 
+// Functions declared as overlays, per program
+inline constexpr u32 maxOverlays = 16;
+
 struct Node {
     enum Type {
         Program
@@ -49,12 +66,22 @@ struct Sym {
         CAST_GE,
     } type = U32;
 
-    bool isCalled(){
-        return flags & 1;
+    // Named by compiled code, so a function has to be compiled too
+    bool isReferenced(){
+        return !isTemp() && (flags & 1);
     }
-    void setCalled(){
+    void setReferenced(){
         flags |= 1 << 0;
     }
+    // Temps only: points into a const array. Shares the bit with
+    // isReferenced, which only names use.
+    bool isReadOnly(){
+        return isTemp() && (flags & 1);
+    }
+    void setReadOnly(){
+        if(isTemp())
+            flags |= 1 << 0;
+    }
     bool isInStack(){
         return (scopeId != 0) || isTemp();
     }
@@ -142,7 +169,7 @@ struct Sym {
     }
     template <typename T>
     void setConstant(T v){
-        setConstant(reinterpret_cast<u32>(v));
+        setConstant(u32(reinterpret_cast<uintptr_t>(v)));
     }
     bool clearKCTV(){
         if( flags & (1 << 6) )
@@ -162,6 +189,7 @@ public:
     } reg[maxReg];
     u32 maxAge = 1;
     u32 useMap = 0;
+    u32 pinned = 0; // registers a local keeps for the whole function
 
     using Spill_t = void (*)(void *data, u32 sym);
     Spill_t spill;
@@ -171,8 +199,9 @@ public:
         return reg < maxReg;
     }
 
+    // Temporaries can also address through a pinned pointer
     void verify(u32 sym, u32 r){
-        if(isValid(r) && reg[r].sym != sym && reg[r].sym != ~u32{}){
+        if(isValid(r) && !isPinned(r) && reg[r].sym != sym && reg[r].sym != ~u32{}){
             LOG("BUG: Sym ", sym, " references reg ", r, ", assigned to ", reg[r].sym, "\n");
         }
     }
@@ -189,7 +218,7 @@ public:
     }
 
     void invalidate(cg::RegLow r){
-        if(!isValid(r.value))
+        if(!isValid(r.value) || isPinned(r.value))
             return;
         auto &c = reg[r.value];
         if(c.hold){
@@ -223,29 +252,39 @@ public:
     }
 
     cg::RegLow operator [] (u32 symId){
+        return allocate(symId, true);
+    }
+
+    // With reuse, the register symId is already in, else the one it is
+    // pinned to, before allocating a new one
+    cg::RegLow allocate(u32 symId, bool reuse = false){
         u32 p = 0;
         for(; p<maxReg; ++p){
-            if(reg[p].sym == symId){
+            if(reuse && reg[p].sym == symId && !isPinned(p)){
                 reg[p].age = maxAge++;
                 return cg::RegLow(p);
             }
-            if(!reg[p].hold) break;
+            if(!reg[p].hold && !isPinned(p)) break;
         }
         u32 age = reg[p].age;
-        for(u32 i = maxReg - 1, pp = p; i > pp; --i){
+        // Ties go to the lowest register, so leaf functions can stay in R0-R3
+        for(u32 i = p + 1; i < maxReg; ++i){
             auto& r = reg[i];
-            if(r.sym == symId){
+            if(reuse && r.sym == symId && !isPinned(i)){
                 r.age = maxAge++;
                 return cg::RegLow(i);
             }
-            if(!r.hold && r.age < age){
+            if(!r.hold && !isPinned(i) && r.age < age){
                 age = r.age;
                 p = i;
             }
         }
+        u32 home = homeOf(symId);
+        if(reuse && isValid(home))
+            return cg::RegLow(home);
 
         // LOGD("Allocate R", p + 1, " to ", symId, "\n");
-        if(reg[p].sym != ~u32{}){
+        if(reg[p].sym != ~u32{} && reg[p].sym != symId){
             // LOGD("Spilling ", reg[p].sym, "\n");
             spill(data, reg[p].sym);
         }
@@ -277,6 +316,41 @@ public:
         return useMap;
     }
 
+    bool isPinned(u32 r){
+        return (pinned >> r) & 1;
+    }
+
+    void pin(u32 symId, cg::RegLow r){
+        auto &c = reg[r.value];
+        c.sym = symId;
+        c.age = 0;
+        c.hold = 0;
+        pinned |= 1 << r.value;
+        useMap |= 1 << r.value;
+    }
+
+    u32 homeOf(u32 symId){
+        for(u32 p = 0; pinned >> p; ++p){
+            if(isPinned(p) && reg[p].sym == symId)
+                return p;
+        }
+        return ~u32{};
+    }
+
+    void unpin(cg::RegLow r){
+        pinned &= ~(1 << r.value);
+        invalidate(r);
+    }
+
+    void unpin(){
+        u32 regs = pinned;
+        pinned = 0;
+        for(u32 p = 0; regs >> p; ++p){
+            if((regs >> p) & 1)
+                invalidate(cg::RegLow(p));
+        }
+    }
+
     void clearUseMap(){
         useMap = 0;
     }
@@ -299,6 +373,27 @@ class Pine {
     RegAlloc regAlloc;
     CodeGen& codegen;
     u32 nextLabel = 1, returnLabel = 0;
+    u32 functionSym = invalidSym, entryLabel = 0, tailLabel = 0;
+    u32 tailLocation = ~u32{};
+    bool tailValue = false, tailCalled = false;
+
+    // Plain functions whose body is a short `return <expression>`
+    static constexpr u32 maxInlines = 16, maxInlineTokens = 12, maxInlineDepth = 2;
+    struct Inline {
+        u32 hash, location, line;
+    } inlines[maxInlines];
+    u32 inlineCount = 0, inlineDepth = 0, inlinedCalls = 0, inlinedSym = invalidSym;
+    // Locals kept in R4-R6 for a whole function, and how often the others
+    // went through memory
+    static constexpr u32 maxPinned = 3, maxPinCandidates = 16, maxLoopNest = 8, maxParenNest = 8, pinWeight = 16;
+    u32 pinnedLocals = 0, spills = 0, reloads = 0;
+    u32 pinHash[maxPinned] = {}, pinScope = invalidSym, firstHome = 4;
+    // Arrays the loops being compiled index by their counter, through a
+    // pointer in a register of its own
+    struct Stride {
+        u32 array, counter, pointer, reg;
+    } strides[maxPinned];
+    u32 strideCount = 0, stridedArrays = 0;
     u32 preserveFlags = 0;
     u32 lblBreak = ~u32{}, lblContinue = ~u32{};
     bool strict = false;
@@ -308,19 +403,35 @@ class Pine {
     void * (*allocator)(u32 size);
     void (*gcLock)(bool);
     void (*setRooted)(u32 ptr);
+    void * (*constArray)(const u32 *data, u32 size) = nullptr;
+    bool (*isConstArray)(u32 ptr) = nullptr;
+    bool constLiteral = false;
+    void (*callSite)(u32 address) = nullptr;
+    void (*stackFrame)(u32 slots, u32 saved, const u32 *pointers) = nullptr;
+    u32 (*allocateCards)() = nullptr;
+    u32 cardTable = 0;
+    u32 cardShift = 0;
+    u32 overlayHandler = 0;
+    bool (*storeOverlay)(u32 id, u32 address, u32 size, u32 entry) = nullptr;
+    u32 overlayHashes[maxOverlays];
+    u32 overlayCount = 0;
+    u32 overlay = ~u32{}; // id of the overlay being compiled
+    u32 slotPointers[4] = {0,0,0,0}; // stack slots that may hold an array
     u32 restrictCall[4] = {0,0,0,0};
 
     SymTable& symTable;
     ResTable& resTable;
     File a2l;
 
-    void toBranch(u32 label){
+    // Branches to label if the expression is false, or if it is true
+    // for the back-edge of a loop
+    void toBranch(u32 label, bool ifTrue = false){
         auto& sym = symTable[symId].hitTemp();
         if(sym.type < Sym::CAST_EQ){
             commitAll();
             load(symId);
             codegen.CMP(cg::RegLow(sym.reg), 0);
-            codegen.B(cg::EQ, label);
+            codegen.B(ifTrue ? cg::NE : cg::EQ, label);
             invalidateRegisters();
         } else {
             preserveFlags++;
@@ -335,6 +446,8 @@ class Pine {
             case Sym::CAST_GT: code = cg::GT; break;
             case Sym::CAST_GE: code = cg::GE; break;
             }
+            if(ifTrue)
+                code = cg::ConditionCode(code ^ 1);
             codegen.B(code, label);
         }
     }
@@ -355,6 +468,8 @@ class Pine {
             "let"_token,
             "var"_token,
             "function"_token,
+            "compact"_token,
+            "overlay"_token,
             "return"_token,
             "if"_token,
             "else"_token,
@@ -392,6 +507,10 @@ class Pine {
     }
 
     bool isCompareOperator(){
+        return isCompareOperator(token);
+    }
+
+    bool isCompareOperator(u32 token){
         switch(token){
         case "==="_token:
         case "=="_token:
@@ -555,6 +674,20 @@ class Pine {
         }
         LOGD("COMMIT ", symId, " reg:", sym.reg, " hit:", sym.wasHit(), " kctv:", sym.kctv, "\n");
         sym.clearDirty();
+        // A pinned local's register is its memory. Like a store, moving
+        // the value there leaves the flags alone.
+        u32 home = regAlloc.homeOf(symId);
+        if(regAlloc.isValid(home)){
+            if(sym.reg == home)
+                return home;
+            if(regAlloc.isValid(sym.reg)){
+                boolCast(sym);
+                codegen.MOV(cg::RegLow(home), cg::RegLow(sym.reg));
+            }else if(sym.hasKCTV()){
+                codegen.LDRI(cg::RegLow(home), sym.kctv, preserveFlags);
+            }
+            return home;
+        }
         if(sym.hasKCTV() && !sym.memInit()){
             sym.setMemInit(sym.kctv);
         }
@@ -580,11 +713,26 @@ class Pine {
             codegen.LDRI(Rt, dataSection + bank, preserveFlags);
             codegen.STR(reg, Rt, offset);
         }else{
+            spills++;
             codegen.STR(reg, cg::SP, sym.address << 2);
+            bool isPointer = sym.type != Sym::BOOL &&
+                (!sym.hasKCTV() || memoryMap.inHeap(sym.kctv));
+            if(isPointer && sym.address < 128)
+                slotPointers[sym.address >> 5] |= 1 << (sym.address & 31);
         }
         return sym.reg;
     }
 
+    // Pinned locals move with MOVS, so they are committed before setting
+    // the flags a branch tests
+    void commitPinned(){
+        for(u32 i = 0; i < RegAlloc::maxReg; ++i){
+            u32 id = regAlloc[cg::RegLow(i)];
+            if(regAlloc.isPinned(i) && id != invalidSym)
+                commit(symTable[id], id);
+        }
+    }
+
     bool spill(cg::RegLow reg){
         u32 symId = regAlloc[reg];
         if(symId != invalidSym){
@@ -710,6 +858,36 @@ class Pine {
         return symTable[symId];
     }
 
+    // Write barrier for storing valueId through address. Known values
+    // outside the heap can't keep an array alive and skip it.
+    void markCard(cg::RegLow address, u32 valueId){
+        auto &value = symTable[valueId];
+        if(!cardTable || (value.hasKCTV() && !memoryMap.inHeap(value.kctv)))
+            return;
+        u32 tmpId = createTmpSymbol();
+        bool held = regAlloc.isLocked(address);
+        regAlloc.hold(address);
+        auto reg = regAlloc[tmpId];
+        if(!held)
+            regAlloc.release(address);
+        auto &tmp = symTable[tmpId];
+        tmp.reg = reg.value;
+        tmp.clearKCTV();
+        codegen.LSLS(reg, address, 24 - cardShift);
+        codegen.LSRS(reg, reg, 24);
+        codegen.LDRI(Rt, cardTable);
+        codegen.STRB(Rt, reg, Rt);
+        tmp.hitTemp();
+    }
+
+    // Loads an address to store through, using a loop's pointer in place
+    Sym &loadAddress(u32 symId){
+        auto &sym = symTable[symId];
+        if(regAlloc.isValid(sym.reg) && regAlloc.isPinned(sym.reg))
+            return sym.hitTemp();
+        return load(symId);
+    }
+
 public:
     Pine(Tokenizer& tok, CodeGen& cg, SymTable& symTable, ResTable& resTable, u32 dataSection) :
         tok(tok),
@@ -753,6 +931,32 @@ public:
         this->allocator = allocator;
     }
 
+    void setConstArrays(void *(*constArray)(const u32 *, u32), bool (*isConstArray)(u32)){
+        this->constArray = constArray;
+        this->isConstArray = isConstArray;
+    }
+
+    void setStackMaps(void (*callSite)(u32), void (*stackFrame)(u32, u32, const u32 *)){
+        this->callSite = callSite;
+        this->stackFrame = stackFrame;
+    }
+
+    // With a "use incremental"; directive, stores into arrays also set
+    // byte ((address >> shift) & 0xFF) of the table allocate() returns to
+    // the low byte of its address, which must not be zero.
+    void setCardTable(u32 (*allocate)(), u32 shift){
+        this->allocateCards = allocate;
+        this->cardShift = shift;
+    }
+
+    // Overlay functions are reached through a resident stub that calls
+    // handler(id, r0-r7). Their code is compiled after the stub, handed
+    // to store() and then dropped from the code section.
+    void setOverlays(u32 handler, bool (*store)(u32 id, u32 address, u32 size, u32 entry)){
+        this->overlayHandler = handler;
+        this->storeOverlay = store;
+    }
+
     const char *varName(){
         if(!isName()){
             setError("Expected variable name");
@@ -776,6 +980,14 @@ public:
         }
     }
 
+    bool isWritable(u32 symId){
+        if(symId != invalidSym && symTable[symId].isReadOnly()){
+            setError("Const arrays are read-only");
+            return false;
+        }
+        return true;
+    }
+
     void unaryExpression(){
         auto op = token;
         bool isUnary = isUnaryOperator();
@@ -783,6 +995,8 @@ public:
         if(isUnaryOperator()) unaryExpression();
         else value();
         if(!isUnary) return;
+        if((op == "++"_token || op == "--"_token) && !isWritable(symId))
+            return;
         auto &sym = symTable[symId];
         if(sym.hasKCTV()){
             u32 tmpId = createTmpSymbol();
@@ -898,6 +1112,8 @@ public:
         case "++"_token: {
             auto token = this->token;
             accept();
+            if(!isWritable(symId))
+                return;
             auto &sym = symTable[symId];
             if(sym.isDeref()){
                 auto tmpId = createTmpSymbol();
@@ -935,15 +1151,27 @@ public:
                 auto &tmp = symTable[tmpId];
                 this->symId = tmpId;
                 auto reg = regAlloc[tmpId];
-                if(token == "++"_token){
-                    codegen.ADDS(reg, cg::RegLow(sym.reg), 1);
+                if(regAlloc.isPinned(sym.reg)){
+                    // The old value goes to the temporary instead
+                    auto home = cg::RegLow(sym.reg);
+                    codegen.MOVS(reg, home);
+                    if(token == "++"_token){
+                        codegen.ADDS(home, 1);
+                    }else{
+                        codegen.SUBS(home, 1);
+                    }
+                    tmp.reg = reg.value;
                 }else{
-                    codegen.SUBS(reg, cg::RegLow(sym.reg), 1);
+                    if(token == "++"_token){
+                        codegen.ADDS(reg, cg::RegLow(sym.reg), 1);
+                    }else{
+                        codegen.SUBS(reg, cg::RegLow(sym.reg), 1);
+                    }
+                    regAlloc.assign(tmpId, cg::RegLow(sym.reg));
+                    tmp.reg = sym.reg;
+                    regAlloc.assign(symId, reg);
+                    sym.reg = reg.value;
                 }
-                regAlloc.assign(tmpId, cg::RegLow(sym.reg));
-                tmp.reg = sym.reg;
-                regAlloc.assign(symId, reg);
-                sym.reg = reg.value;
                 sym.setDirty();
                 tmp.clearKCTV();
             }
@@ -958,31 +1186,45 @@ public:
                 return;
             }
             u32 tmpId = createTmpSymbol();
+            u32 stride = strideOf(baseId, symId);
             auto &sym = symTable[symId].hitTemp();
             auto &base = symTable[baseId].hitTemp();
             auto &tmp = symTable[tmpId];
             if(base.hasKCTV() && sym.hasKCTV()){
                 tmp.setKCTV(base.kctv + sym.kctv * 4);
+            }else if(regAlloc.isValid(stride)){
+                // The loop already points at the element
+                tmp.reg = stride;
+                tmp.clearKCTV();
             }else{
                 load(baseId);
                 load(symId);
-                auto reg = cg::RegLow(sym.reg);
-                spill(sym, symId);
-                regAlloc.assign(tmpId, cg::RegLow(reg));
-                codegen.LSLS(Rt, reg, 2);
+                // A pinned index keeps its register
+                auto index = cg::RegLow(sym.reg);
+                bool pinned = regAlloc.isPinned(index.value);
+                auto reg = pinned ? regAlloc[tmpId] : index;
+                if(!pinned){
+                    spill(sym, symId);
+                    regAlloc.assign(tmpId, reg);
+                }
+                codegen.LSLS(Rt, index, 2);
                 codegen.ADDS(reg, cg::RegLow(base.reg), Rt);
                 tmp.reg = reg.value;
                 tmp.clearKCTV();
             }
             tmp.setDeref();
+            if(base.hasKCTV() && isConstArray && isConstArray(base.kctv))
+                tmp.setReadOnly();
             symId = tmpId;
             break;
         }
         case "("_token:{
             u32 fncId = symId;
             u32 argc, argv[7];
+            bool tail = tailValue;
             callArgs(argc, argv);
-            writeCall(fncId, argc, argv);
+            tail = tail && (token == ";"_token || token == "}"_token);
+            writeCall(fncId, argc, argv, tail);
             break;
         }
 
@@ -997,14 +1239,21 @@ public:
         symTable[symId].hitTemp();
     }
 
+    // Folds like the runtime divides: signed, and by zero gives zero
+    static u32 sdiv(u32 l, u32 r){
+        if(!r) return 0;
+        if(r == ~u32{}) return -l;
+        return s32(l) / s32(r);
+    }
+
     bool doConstOp(u32 lkctv, u32 op, u32 kctv, Sym &sym){
         Sym::Type type;
         bool matched = true;
         switch(op){
         case "+"_token:     kctv = lkctv + kctv;           type = Sym::S32;         break;
         case "*"_token:     kctv = lkctv * s32(kctv);      type = Sym::S32;         break;
-        case "/"_token:     kctv = lkctv / kctv;           type = Sym::S32;         break;
-        case "%"_token:     kctv = lkctv % kctv;           type = Sym::S32;         break;
+        case "/"_token:     kctv = sdiv(lkctv, kctv);      type = Sym::S32;         break;
+        case "%"_token:     kctv = kctv ? lkctv % kctv : lkctv; type = Sym::S32;    break;
         case "-"_token:     kctv = lkctv - kctv;           type = Sym::S32;         break;
         case "<<"_token:    kctv = lkctv << kctv;          type = Sym::S32;         break;
         case ">>"_token:    kctv = s32(lkctv) >> kctv;     type = Sym::S32;         break;
@@ -1014,10 +1263,10 @@ public:
         case "|"_token:     kctv = lkctv | kctv;           type = Sym::S32;         break;
         case "||"_token:    kctv = lkctv || kctv;          type = Sym::S32;         break;
         case "^"_token:     kctv = lkctv ^ kctv;           type = Sym::S32;         break;
-        case "<"_token:     kctv = lkctv < kctv;           type = Sym::BOOL;        break;
-        case ">"_token:     kctv = lkctv > kctv;           type = Sym::BOOL;        break;
-        case "<="_token:    kctv = lkctv <= kctv;          type = Sym::BOOL;        break;
-        case ">="_token:    kctv = lkctv >= kctv;          type = Sym::BOOL;        break;
+        case "<"_token:     kctv = s32(lkctv) < s32(kctv);  type = Sym::BOOL;       break;
+        case ">"_token:     kctv = s32(lkctv) > s32(kctv);  type = Sym::BOOL;       break;
+        case "<="_token:    kctv = s32(lkctv) <= s32(kctv); type = Sym::BOOL;       break;
+        case ">="_token:    kctv = s32(lkctv) >= s32(kctv); type = Sym::BOOL;       break;
         case "!=="_token:
         case "!="_token:    kctv = lkctv != kctv;          type = Sym::BOOL;        break;
         case "==="_token:
@@ -1032,7 +1281,47 @@ public:
         return matched;
     }
 
+    // Moves a pinned local out of its register, for operations that
+    // overwrite their operand's register with the result
+    void leaveHome(u32 id){
+        u32 home = regAlloc.homeOf(id);
+        auto &sym = symTable[id];
+        if(!regAlloc.isValid(home) || (regAlloc.isValid(sym.reg) && sym.reg != home))
+            return;
+        auto reg = regAlloc.allocate(id);
+        if(sym.reg != home && sym.hasKCTV()){
+            codegen.LDRI(reg, sym.kctv);
+        }else{
+            boolCast(sym);
+            codegen.MOV(reg, cg::RegLow(home));
+            sym.clearDirty();
+        }
+        sym.reg = reg.value;
+    }
+
     void doNonConstOp(u32 lsymId, u32 op, u32 rsymId, u32 assignId){
+        if(assignId != lsymId){
+            auto &lsym = symTable[lsymId];
+            auto &rsym = symTable[rsymId];
+            bool commutes = op == "+"_token || op == "*"_token ||
+                op == "^"_token || op == "|"_token || op == "&"_token;
+            // Overwrite the temporary instead of a variable that would
+            // have to be saved first
+            if(commutes && !lsym.isTemp() && !lsym.hasKCTV() && !lsym.isDeref() &&
+               rsym.isTemp() && !rsym.hasKCTV()){
+                u32 swap = lsymId;
+                lsymId = rsymId;
+                rsymId = swap;
+                symId = rsymId;
+            }
+            leaveHome(lsymId);
+            if(symTable[lsymId].isInRange(0, 0xFF) && (op == "+"_token || isCompareOperator(op)))
+                leaveHome(rsymId);
+        }
+        doOpInRegisters(lsymId, op, rsymId, assignId);
+    }
+
+    void doOpInRegisters(u32 lsymId, u32 op, u32 rsymId, u32 assignId){
         bool doAssign = assignId == lsymId;
         auto &lsym = symTable[lsymId];
         auto &rsym = symTable[rsymId];
@@ -1176,6 +1465,7 @@ public:
         case "!="_token:
         {
             // LOGD("Operator ", (op == ">"_token ? ">" : "!="), "\n");
+            commitPinned();
             renameSym = lsymId;
             if(rsym.isInRange(0, 255)){
                 commit(load(lsymId), lsymId);
@@ -1232,9 +1522,10 @@ public:
 
         if(assignId != invalidSym){
             if(assignId != lsymId){
-                auto &ptr = load(assignId);
+                auto &ptr = loadAddress(assignId);
                 auto &val = load(symId).unhitTemp();
                 codegen.STR(cg::RegLow(val.reg), cg::RegLow(ptr.reg));
+                markCard(cg::RegLow(ptr.reg), symId);
             }else{
                 assign(lsymId);
             }
@@ -1266,7 +1557,7 @@ public:
                 lsymId = createTmpSymbol();
                 auto reg = regAlloc[lsymId];
                 sym.clearDeref();
-                load(assignId).unhitTemp();
+                loadAddress(assignId).unhitTemp();
                 auto &vsym = symTable[lsymId];
                 vsym.reg = reg.value;
                 vsym.clearKCTV();
@@ -1375,6 +1666,8 @@ public:
         logicExpression();
         while(!error && isAssignOperator()){
             auto lsymId = symId;
+            if(!isWritable(lsymId))
+                return;
             auto op = getNonAssignOperator();
             accept();
             logicExpression();
@@ -1428,13 +1721,16 @@ public:
     }
 
     u32 createSymbol(const char *name, u32 scopeId, bool isImplicit){
-        u32 token = hash(name);
+        return createHashedSymbol(hash(name), scopeId);
+    }
+
+    u32 createHashedSymbol(u32 token, u32 scopeId){
         u32 id = 0;
         u32 evict = invalidSym;
         for(auto &sym : symTable){
             regAlloc.verify(id, sym.reg);
             if(token == sym.hash && sym.scopeId == scopeId){
-                LOGD("redeclared variable ", name, " id:", id, "\n");
+                LOGD("redeclared variable ", token, " id:", id, "\n");
                 return id;
             }
             if(sym.isTemp() && sym.wasHit()){
@@ -1461,10 +1757,11 @@ public:
         sym.clearDirty();
         sym.type = Sym::Type::U32;
         sym.line = tok.getLine();
+        pinDeclared(id);
         // if(scopeId == 0 && isImplicit){
         //     LOG(id, ") ", name, "\n");
         // }else{
-        LOGD("declared variable ", name, " ", id, " hash:", sym.hash, "\n");
+        LOGD("declared variable ", id, " hash:", sym.hash, "\n");
         // }
         return id;
     }
@@ -1480,7 +1777,7 @@ public:
     void addRestricted(void *ptr){
         for(u32 i=0; i<4; ++i){
             if(!restrictCall[i]){
-                restrictCall[i] = reinterpret_cast<u32>(ptr);
+                restrictCall[i] = reinterpret_cast<uintptr_t>(ptr);
                 return;
             }
         }
@@ -1538,6 +1835,8 @@ public:
     }
 
     void value(){
+        bool tail = tok.getLocation() == tailLocation;
+        u32 nameId = invalidSym;
         bool requireCall = accept("new"_token);
         if(token == "["_token){
             arrayLiteral();
@@ -1559,30 +1858,37 @@ public:
         } else if(tok.isString()){
             stringLiteral();
         } else if(isName()) {
-            symId = findOrCreateSymbol(scopeId, true);
+            symId = nameId = findOrCreateSymbol(scopeId, true);
         } else {
             setError("value: Unexpected token");
         }
         if(requireCall && token != "("_token){
             writeCall(symId, 0, nullptr);
         }
+        inlinedSym = invalidSym;
         while(!error && isPostfixOperator()){
+            tailValue = tail && !requireCall;
             postfixOperator();
         }
+        // A function only called inlined doesn't need compiling
+        if(nameId != invalidSym && nameId != inlinedSym)
+            symTable[nameId].setReferenced();
     }
 
     u32 arrayId = 0;
     void arrayLiteral(){
+        bool readOnly = constLiteral && constArray;
+        constLiteral = false;
         if(!accept("["_token)){
             setError("Unexpected token (not [)");
             return;
         }
         // LOG("begin Array ", arrayId, "\n");
         gcLock(true);
-        auto ptr = reinterpret_cast<u32*>(0x20004000);
+        auto ptr = reinterpret_cast<u32*>(dataSection);
         u32 start = arrayId;
         while(!error && tok.getClass() != TokenClass::Eof){
-            if(arrayId * 4 >= 0x800){
+            if(arrayId * 4 >= memoryMap.dataSize){
                 setError("Array too big");
                 return;
             }
@@ -1604,9 +1910,12 @@ public:
         }
         u32 byteSize = (arrayId - start) << 2;
         // LOG("Creating array of size ", byteSize, "\n");
-        void *out = allocator(byteSize);
+        void *out = readOnly ? constArray(ptr + start, byteSize) : nullptr;
+        if(!out){
+            out = allocator(byteSize);
+            memcpy(out, ptr + start, byteSize);
+        }
         gcLock(false);
-        memcpy(out, ptr + start, byteSize);
         // LOG("end Array ", start, "[0]=", reinterpret_cast<uint32_t*>(out)[0], "\n");
         arrayId = start;
         u32 tmpId = createTmpSymbol();
@@ -1619,7 +1928,7 @@ public:
         u32 start = tok.getLocation();
         u32 len = 0;
         u32 hash = 5381 * 31 + '"';
-        char *ptr = reinterpret_cast<char*>(0x20004000 + arrayId * 4);
+        char *ptr = reinterpret_cast<char*>(dataSection + arrayId * 4);
         while(tok.isString()){
             char ch = tok.getText()[0];
             if(ch == '\\'){
@@ -1629,7 +1938,7 @@ public:
                 default: break;
                 }
             }
-            if(len < (0x800 - arrayId * 4)){
+            if(len < (memoryMap.dataSize - arrayId * 4)){
                 ptr[len] = ch;
             }
             len++;
@@ -1638,7 +1947,7 @@ public:
         }
         File *file = resTable.write(hash);
         if( file ){
-            if(len < (0x800 - arrayId * 4)){
+            if(len < (memoryMap.dataSize - arrayId * 4)){
                 file->write(ptr, len);
                 (*file) << '\0';
             } else {
@@ -1831,7 +2140,7 @@ public:
         default: break;
         }
         sym.hitTemp();
-        codegen.LDRI(Rt, 0xA0000020);
+        codegen.LDRI(Rt, memoryMap.buttons);
         u32 tmpId = createTmpSymbol();
         auto reg = regAlloc[tmpId];
         auto &tmp = symTable[tmpId];
@@ -1851,7 +2160,7 @@ public:
 
         {
             auto &sym = symTable[argv[0]];
-            if(sym.isInRange(0x10000000, 0x10008000)){
+            if(sym.isInRange(memoryMap.heap, memoryMap.heapEnd())){
                 auto array = reinterpret_cast<u32*>(sym.kctv);
                 tmp.setKCTV(array[-1] & 0xFFFF);
                 symId = tmpId;
@@ -1888,20 +2197,132 @@ public:
         }
     }
 
-    void writeCall(u32 symId, u32 argc, u32* argv){
+    // Compiles a call to a function skipBody found simple enough in place:
+    // the arguments are bound to its parameters in a scope of their own,
+    // so their known values propagate into its expression.
+    bool writeInline(u32 symId, u32 argc, u32 *argv){
+        auto &call = symTable[symId];
+        if(inlineDepth == maxInlineDepth || symId == functionSym || call.scopeId != 0)
+            return false;
+        if(call.type != Sym::UNCOMPILED && call.type != Sym::FUNCTION)
+            return false;
+        u32 i = 0;
+        while(i < inlineCount && inlines[i].hash != call.hash)
+            ++i;
+        if(i == inlineCount)
+            return false;
+
+        Tokenizer::Mark resume;
+        tok.mark(resume);
+        u32 resumeToken = token, callerScope = scopeId;
+        scopeId = ++maxScope;
+        clearHashCache();
+        tok.setLocation(inlines[i].location, inlines[i].line);
+        accept();
+        accept(); // name
+        accept("("_token);
+
+        u32 argi = 0;
+        while(!error && isName()){
+            u32 id = createSymbol(scopeId, false);
+            if(argi < argc){
+                this->symId = argv[argi++];
+            }else{
+                this->symId = createTmpSymbol();
+                symTable[this->symId].setKCTV(0);
+            }
+            assign(id);
+            if(!accept(","_token))
+                break;
+        }
+        for(u32 j=0; j<argc; ++j)
+            symTable[argv[j]].hitTemp();
+        accept(")"_token);
+        accept("{"_token);
+        accept("return"_token);
+
+        inlineDepth++;
+        expression();
+        inlineDepth--;
+
+        // The parameters die here, without being stored
+        u32 id = 0;
+        for(auto& sym : symTable){
+            regAlloc.verify(id++, sym.reg);
+            if(sym.scopeId == scopeId && !sym.isTemp()){
+                sym.clearDirty();
+                symTable.dirtyIterator();
+            }
+        }
+        u32 resultId = this->symId;
+        if(!symTable[resultId].isTemp()){
+            resultId = createTmpSymbol();
+            assign(resultId);
+        }
+        id = 0;
+        for(auto& sym : symTable){
+            regAlloc.verify(id++, sym.reg);
+            if(sym.scopeId == scopeId && !sym.isTemp()){
+                if(regAlloc.isValid(sym.reg))
+                    regAlloc.invalidate(cg::RegLow(sym.reg));
+                sym.reg = invalidReg;
+                sym.hash = 0;
+                sym.hitTemp();
+                symTable.dirtyIterator();
+            }
+        }
+
+        scopeId = callerScope;
+        clearHashCache();
+        tok.reset(resume);
+        token = resumeToken;
+        this->symId = resultId;
+        inlinedSym = symId;
+        inlinedCalls++;
+        return true;
+    }
+
+    // `return f(...)` jumps instead of calling: back to the top of the
+    // function for self recursion, otherwise through the tail epilogue
+    // with the callee in R12. That pops LR through R3, so argc < 4.
+    bool writeTailCall(u32 symId, u32 argc){
+        if(symId == functionSym){
+            codegen.B(cg::Label(entryLabel));
+        }else if(CodeGen::hasLinkRegister && argc < 4 && !isBytecode()){
+            loadToRegister(symId, tempReg);
+            nativeMOV(cg::R12, Rt);
+            if(!tailLabel)
+                tailLabel = nextLabel++;
+            codegen.B(cg::Label(tailLabel));
+        }else{
+            return false;
+        }
+        for(u32 i=0; i<argc; ++i)
+            regAlloc.release(cg::RegLow(i));
+        invalidateRegisters();
+        this->symId = createTmpSymbol();
+        symTable[this->symId].setKCTV(0);
+        tailCalled = true;
+        return true;
+    }
+
+    void writeCall(u32 symId, u32 argc, u32* argv, bool tail = false){
         if(error)
             return;
+        inlinedSym = invalidSym;
         if(callIntrinsic(symId, argc, argv)){
             auto &sym = symTable[symId];
             if(!sym.memInit())
                 sym.setMemInit(0);
             return;
         }
+        if(writeInline(symId, argc, argv))
+            return;
         LOGD("Write call\n");
         bool isConstexpr;
         {
             auto &call = symTable[symId];
-            call.setCalled();
+            call.setReferenced();
             if(call.hasKCTV() && call.kctv == 0)
                 call.clearKCTV();
             isConstexpr = argc <= 4 && call.isConstexpr();
@@ -1957,9 +2378,12 @@ public:
         }
         commitScratch();
 
+        if(tail && writeTailCall(symId, argc))
+            return;
+
         auto here = codegen.tell() + baseAddress;
         auto &call = symTable[symId];
-        if((call.type == Sym::Type::FUNCTION) && (call.kctv > here - 0x7FFFFF)){
+        if((call.type == Sym::Type::FUNCTION) && (call.kctv > here - 0x7FFFFF) && overlay == ~u32{}){
             // codegen.BKPT(0);
             codegen.BL(call.kctv - functionAddress);
 //            LOG("CKCTV ", (void*) call.kctv, " ", (void*) functionAddress, "\n");
@@ -1967,6 +2391,8 @@ public:
             loadToRegister(symId, tempReg);
             codegen.BLX(Rt);
         }
+        if(callSite && inCodeSection())
+            callSite(codegen.tell() + baseAddress);
 
         for(u32 i=0; i<argc; ++i)
             regAlloc.release(cg::RegLow(i));
@@ -2011,15 +2437,22 @@ public:
                 evict.reg = invalidReg;
             }
         }
-        
+
+        u32 home = regAlloc.homeOf(symId);
         bool deref = sym.isDeref();
         sym.clearDeref();
         if(regAlloc.isValid(sym.reg)){
+            // A pinned local leaves its value at home as it moves
+            if(regAlloc.isValid(home) && regAlloc.isValid(reg))
+                commit(sym, symId);
             if(deref){
                 codegen.LDR(cg::RegLow(reg), cg::RegLow(sym.reg), 0);
             }else{
                 boolCast(sym);
-                codegen.MOVS(cg::RegLow(reg), cg::RegLow(sym.reg));
+                if(regAlloc.isPinned(sym.reg))
+                    codegen.MOV(cg::RegLow(reg), cg::RegLow(sym.reg));
+                else
+                    codegen.MOVS(cg::RegLow(reg), cg::RegLow(sym.reg));
             }
             if(regAlloc.isValid(reg))
                 sym.reg = reg;
@@ -2029,6 +2462,9 @@ public:
             sym.reg = reg;
         if(sym.hasKCTV()){
             codegen.LDRI(cg::RegLow(reg), sym.kctv, preserveFlags);
+        }else if(regAlloc.isValid(home)){
+            if(reg != home)
+                codegen.MOV(cg::RegLow(reg), cg::RegLow(home));
         }else{
             if(sym.address == invalidAddress){
                 if(!sym.isInStack()) sym.address = globalScopeSize++;
@@ -2040,6 +2476,7 @@ public:
                 codegen.LDRI(cg::RegLow(reg), dataSection + bank, preserveFlags);
                 codegen.LDR(cg::RegLow(reg), cg::RegLow(reg), offset);
             } else {
+                reloads++;
                 codegen.LDR(cg::RegLow(reg), cg::SP, sym.address << 2);
             }
         }
@@ -2062,9 +2499,10 @@ public:
         if(sym.isDeref()){
             LOGD("Deref store ", id, "[0] = ", symId, "\n");
             sym.clearDeref();
-            load(id);
+            loadAddress(id);
             load(symId);
             codegen.STR(cg::RegLow(evict.reg), cg::RegLow(sym.reg));
+            markCard(cg::RegLow(sym.reg), symId);
             sym.hitTemp();
             return;
         }
@@ -2077,8 +2515,14 @@ public:
             sym.clearKCTV();
             load(symId);
             u32 reg = evict.reg;
-            spill(evict, symId);
-            regAlloc.assign(id, cg::RegLow(reg));
+            if(regAlloc.isPinned(reg)){
+                auto copy = regAlloc[id];
+                codegen.MOV(copy, cg::RegLow(reg));
+                reg = copy.value;
+            }else{
+                spill(evict, symId);
+                regAlloc.assign(id, cg::RegLow(reg));
+            }
             sym.reg = reg;
             sym.setDirty();
         }
@@ -2096,7 +2540,9 @@ public:
                 return;
             }
             newLock++;
+            constLiteral = token == "["_token;
             simpleExpression();
+            constLiteral = false;
             newLock--;
             auto &rval = symTable[symId];
             rval.hitTemp();
@@ -2107,7 +2553,8 @@ public:
                 return;
             }else{
                 sym.setConstant(rval.kctv);
-                setRooted(rval.kctv);
+                if(!isConstArray || !isConstArray(rval.kctv))
+                    setRooted(rval.kctv);
             }
         }while(accept(","_token));
         symId = id;
@@ -2135,6 +2582,46 @@ public:
         symId = id;
     }
 
+    // Skips a function body like deadBlock, telling if it is a single
+    // `return <expression>` short and simple enough to inline. Calls with
+    // more than 4 arguments pass the rest in R4-R6, which the caller's
+    // pinLocals doesn't see, so they aren't.
+    bool skipBody(){
+        if(!accept("{"_token)){
+            setError("1 Unexpected token (not {)");
+            return false;
+        }
+        bool simple = accept("return"_token), operand = false;
+        u32 count = 0, depth = 0, commas[maxParenNest];
+        while(simple && !error){
+            if(depth == 0 && (token == ";"_token || token == "}"_token))
+                break;
+            if(++count > maxInlineTokens || tok.getClass() == TokenClass::Eof || tok.isString() || isKeyword() ||
+               token == "new"_token || token == "{"_token || token == "}"_token ||
+               (token == "["_token && !operand) || ((token == ")"_token || token == "]"_token) && !depth) ||
+               ((token == "("_token || token == "["_token) && depth == maxParenNest) ||
+               (token == ","_token && depth && ++commas[depth - 1] > 3)){
+                simple = false;
+                break;
+            }
+            if(token == "("_token || token == "["_token) commas[depth++] = 0;
+            else if(token == ")"_token || token == "]"_token) depth--;
+            operand = isName() || token == ")"_token || token == "]"_token;
+            accept();
+        }
+        if(simple){
+            accept(";"_token);
+            simple = count && token == "}"_token;
+        }
+        u32 blocks = 1;
+        while(blocks && tok.getClass() != TokenClass::Eof && !error){
+            if(accept("{"_token)) blocks++;
+            else if(accept("}"_token)) blocks--;
+            else accept();
+        }
+        return simple;
+    }
+
     void deadBlock(){
         LOGD("Dead block\n");
         if(!accept("{"_token)){
@@ -2226,14 +2713,14 @@ public:
             return;
         }
 
+        flush();
         codegen[lblTest];
         prenExpression();
         
         if(error)
             return;
         
-        toBranch(lblBreak);
-        codegen.B(lblNext);
+        loopBack(lblNext);
         codegen[lblBreak];
 
         this->lblBreak = prevlblBreak;
@@ -2250,28 +2737,46 @@ public:
         }
         u32 lblTest = nextLabel++;
         u32 lblBreak = nextLabel++;
-        flush();
+        u32 lblBody = nextLabel++;
 
-        codegen[lblTest];
-        prenExpression();
-        if(error)
+        // The test is compiled after the body, so an iteration only takes
+        // the branch back
+        Tokenizer::Mark test;
+        tok.mark(test);
+        u32 testToken = token;
+        if(!accept("("_token)){
+            setError("while: Expected (");
+            return;
+        }
+        skipExpression(")"_token);
+        if(!accept(")"_token)){
+            setError("while: Expected )");
             return;
-
-        auto sym = symTable[symId];
-        if(sym.hasKCTV()){
-            if(!sym.kctv){
-                statementOrBlock();
-                return;
-            }
         }
 
         this->lblBreak = lblBreak;
         this->lblContinue = lblTest;
 
-        toBranch(lblBreak);
-        statementOrBlock();
         flush();
         codegen.B(lblTest);
+        codegen[lblBody];
+        statementOrBlock();
+        if(error)
+            return;
+        flush();
+
+        Tokenizer::Mark end;
+        tok.mark(end);
+        u32 endToken = token;
+        tok.reset(test);
+        token = testToken;
+        codegen[lblTest];
+        prenExpression();
+        if(error)
+            return;
+        loopBack(lblBody);
+        tok.reset(end);
+        token = endToken;
         codegen[lblBreak];
 
         this->lblBreak = prevlblBreak;
@@ -2330,7 +2835,7 @@ public:
         u32 itId = createTmpSymbol();
         u32 maxId = createTmpSymbol();
 
-        // if(symTable[arrId].isInRange(0x10000000, 0x10008000)){
+        // if(symTable[arrId].isInRange(memoryMap.heap, memoryMap.heapEnd())){
         //     u32 kctv = symTable[arrId].kctv;
         //     auto array = reinterpret_cast<u32*>(kctv);
         //     u32 ubound = array[-1] & 0xFFFF;
@@ -2353,6 +2858,7 @@ public:
             max.setKCTV(-4);
             load(maxId).unhitTemp();
             load(itId).unhitTemp();
+            commitPinned();
             codegen.LDRH(cg::RegLow(max.reg), cg::RegLow(it.reg), cg::RegLow(max.reg));
             codegen.CMP( cg::RegLow(max.reg), 0 );
             max.setDirty();
@@ -2423,7 +2929,7 @@ public:
         u32 maxId = createTmpSymbol();
         u32 ubound = 0;
 
-        if(symTable[arrId].isInRange(0x10000000, 0x10008000)){
+        if(symTable[arrId].isInRange(memoryMap.heap, memoryMap.heapEnd())){
             auto array = reinterpret_cast<u32*>(symTable[arrId].kctv);
             ubound = array[-1] & 0xFFFF;
             auto &it = symTable[itId];
@@ -2442,6 +2948,7 @@ public:
             max.setKCTV(-4);
             load(maxId);
             max.unhitTemp();
+            commitPinned();
             codegen.LDRH(cg::RegLow(max.reg), cg::RegLow(it.reg), cg::RegLow(max.reg));
             codegen.LDRI(cg::RegLow(it.reg), 0);
             codegen.CMP(cg::RegLow(max.reg), 0);
@@ -2507,56 +3014,255 @@ public:
     void classicFor(){
         u32 lblTest = nextLabel++;
         u32 lblContinue = nextLabel++;
-        u32 lblEnter = nextLabel++;
+        u32 lblBody = nextLabel++;
         u32 lblBreak = nextLabel++;
 
         this->lblBreak = lblBreak;
         this->lblContinue = lblContinue;
 
-        LOGD("For Condition\n");
-        flush();
-        if(accept(";"_token)){
-            lblTest = lblEnter;
-        }else{
-            codegen[cg::Label(lblTest)];
-            expression();
-            toBranch(lblBreak);
-            if(!accept(";"_token)){
-                setError("for: Expected ;");
-                return;
-            }
+        // The update and the test are compiled after the body, so an
+        // iteration only takes the branch back
+        Tokenizer::Mark test, update, end;
+        tok.mark(test);
+        u32 testToken = token;
+        bool hasTest = token != ";"_token;
+        skipExpression(";"_token);
+        if(!accept(";"_token)){
+            setError("for: Expected ;");
+            return;
         }
-        flush();
-        codegen.B(lblEnter);
-
-        LOGD("For Continue\n");
-        if(accept(")"_token)){
-            lblContinue = lblTest;
-        }else{
-            codegen[cg::Label(lblContinue)];
-            statements();
-            if(!accept(")"_token)){
-                setError("for: Expected )");
-                return;
-            }
-            flush();
+        tok.mark(update);
+        u32 updateToken = token;
+        bool hasUpdate = token != ")"_token;
+        skipExpression(")"_token);
+        if(!accept(")"_token)){
+            setError("for: Expected )");
+            return;
         }
-        codegen.B(cg::Label(lblTest));
-        codegen[cg::Label(lblEnter)];
+        u32 strided = strideArrays(test, testToken, update, updateToken);
+
+        flush();
+        if(hasTest)
+            codegen.B(cg::Label(lblTest));
+        codegen[cg::Label(lblBody)];
 
         LOGD("For Body\n");
         if(token == "{"_token)
             block();
         else
             statements();
-
+        if(error)
+            return;
         flush();
-        codegen.B(cg::Label(lblContinue));
+
+        tok.mark(end);
+        u32 endToken = token;
+        LOGD("For Continue\n");
+        codegen[cg::Label(lblContinue)];
+        for(u32 i = strideCount - strided; i < strideCount; ++i)
+            codegen.ADDS(cg::RegLow(strides[i].reg), 4);
+        if(hasUpdate){
+            tok.reset(update);
+            token = updateToken;
+            statements();
+            flush();
+        }
+
+        LOGD("For Condition\n");
+        if(hasTest){
+            tok.reset(test);
+            token = testToken;
+            codegen[cg::Label(lblTest)];
+            expression();
+            if(error)
+                return;
+            loopBack(lblBody);
+        }else{
+            codegen.B(cg::Label(lblBody));
+        }
+        tok.reset(end);
+        token = endToken;
         codegen[cg::Label(lblBreak)];
 
+        while(strided--){
+            auto &stride = strides[--strideCount];
+            regAlloc.unpin(cg::RegLow(stride.reg));
+            symTable[stride.pointer].hitTemp();
+        }
+
         LOGD("For complete\n");
     }
 
+    // For a loop updated with counter++, gives each array the loop only
+    // indexes by the counter a pointer to the element in a spare R4-R6,
+    // moved 4 bytes per iteration instead of scaling the counter at every
+    // access. Returns how many it set up.
+    u32 strideArrays(const Tokenizer::Mark &test, u32 testToken, const Tokenizer::Mark &update, u32 updateToken){
+        if(!scopeId)
+            return 0;
+        Tokenizer::Mark body;
+        tok.mark(body);
+        u32 bodyToken = token;
+        bool compound = token == "if"_token || token == "do"_token ||
+            token == "while"_token || token == "for"_token;
+
+        tok.reset(update);
+        token = updateToken;
+        bool prefix = accept("++"_token);
+        u32 counter = tok.getClass() == TokenClass::Word && isName() ? token : 0;
+        accept();
+        if((!prefix && !accept("++"_token)) || token != ")"_token)
+            counter = 0;
+
+        u32 arrays[maxPinned], count = 0;
+        u32 counterId = counter ? findLocal(counter) : invalidSym;
+        if(counterId != invalidSym && !compound){
+            tok.reset(body);
+            token = bodyToken;
+            if(!scanIndexing(counter, arrays, count, true))
+                count = 0;
+            tok.reset(body);
+            token = bodyToken;
+            if(count && !scanIndexing(counter, arrays, count, false))
+                count = 0;
+            tok.reset(test);
+            token = testToken;
+            if(count && !scanIndexing(counter, arrays, count, false))
+                count = 0;
+        }
+        tok.reset(body);
+        token = bodyToken;
+
+        u32 added = 0;
+        for(u32 i = 0; i < count; ++i){
+            u32 arrayId = findLocal(arrays[i]);
+            u32 reg = firstHome;
+            while(reg < 4 + maxPinned && regAlloc.isPinned(reg))
+                ++reg;
+            if(arrayId == invalidSym || reg == 4 + maxPinned)
+                continue;
+            auto ptr = cg::RegLow(reg);
+            spill(ptr);
+            u32 pointerId = createTmpSymbol();
+            auto &pointer = symTable[pointerId];
+            pointer.clearKCTV();
+            pointer.clearDirty();
+            pointer.reg = reg;
+            regAlloc.pin(pointerId, ptr);
+
+            auto &base = load(arrayId);
+            auto &index = symTable[counterId];
+            if(index.hasKCTV() && index.kctv < 2){
+                codegen.ADDS(ptr, cg::RegLow(base.reg), index.kctv << 2);
+            }else{
+                if(index.hasKCTV())
+                    codegen.LDRI(Rt, index.kctv << 2);
+                else
+                    codegen.LSLS(Rt, cg::RegLow(load(counterId).reg), 2);
+                codegen.ADDS(ptr, cg::RegLow(symTable[arrayId].reg), Rt);
+            }
+            strides[strideCount++] = {arrayId, counterId, pointerId, reg};
+            stridedArrays++;
+            added++;
+        }
+        return added;
+    }
+
+    // The register pointing at array[counter] in the loops being compiled
+    u32 strideOf(u32 array, u32 counter){
+        for(u32 i = 0; i < strideCount; ++i){
+            if(strides[i].array == array && strides[i].counter == counter)
+                return strides[i].reg;
+        }
+        return invalidReg;
+    }
+
+    // A local, or a global constant, that calls can't change
+    u32 findLocal(u32 hash){
+        u32 id = symTable.find([&](const Sym &sym, u32){
+            return sym.hash == hash && sym.scopeId == scopeId;
+        });
+        if(id == symTable.end()){
+            id = symTable.find([&](const Sym &sym, u32){
+                return sym.hash == hash && sym.scopeId == 0;
+            });
+            if(id == symTable.end() || !symTable[id].isConstant())
+                return invalidSym;
+        }
+        return id;
+    }
+
+    // Scans the statement or block ahead, or the expression up to a ;,
+    // for arrays indexed as array[counter], when collecting. Drops the
+    // arrays it writes, and fails if it writes the counter.
+    bool scanIndexing(u32 counter, u32 *arrays, u32 &count, bool collect){
+        u32 depth = 0, prev[3] = {0, 0, 0};
+        bool named[3] = {false, false, false};
+        bool block = token == "{"_token, declaring = false;
+        while(!error && tok.getClass() != TokenClass::Eof){
+            if(!depth && (token == ";"_token || token == "}"_token))
+                break;
+            bool name = tok.getClass() == TokenClass::Word && isName();
+            if(token == "var"_token || token == "const"_token) declaring = true;
+            else if(token == ";"_token) declaring = false;
+            u32 target = 0;
+            if(named[0] && (isAssignOperator() || token == "++"_token || token == "--"_token))
+                target = prev[0];
+            if(name && (prev[0] == "++"_token || prev[0] == "--"_token || prev[0] == "var"_token ||
+                        prev[0] == "const"_token || (declaring && prev[0] == ","_token)))
+                target = token;
+            if(target && target == counter)
+                return false;
+            for(u32 i = 0; target && i < count; ++i){
+                if(arrays[i] == target)
+                    arrays[i--] = arrays[--count];
+            }
+            if(collect && token == "]"_token && named[0] && prev[0] == counter &&
+               prev[1] == "["_token && named[2] && count < maxPinned){
+                u32 i = 0;
+                while(i < count && arrays[i] != prev[2])
+                    ++i;
+                if(i == count)
+                    arrays[count++] = prev[2];
+            }
+            if(token == "("_token || token == "["_token || token == "{"_token) depth++;
+            else if(token == ")"_token || token == "]"_token || token == "}"_token) depth--;
+            prev[2] = prev[1]; named[2] = named[1];
+            prev[1] = prev[0]; named[1] = named[0];
+            prev[0] = token; named[0] = name;
+            accept();
+            if(block && !depth)
+                break;
+        }
+        return true;
+    }
+
+    // Skips an expression up to the end token outside any brackets, to
+    // be compiled later from a mark
+    void skipExpression(u32 end){
+        u32 depth = 0;
+        while(!error && tok.getClass() != TokenClass::Eof && (depth || token != end)){
+            if(token == "("_token || token == "["_token) depth++;
+            else if(token == ")"_token || token == "]"_token) depth--;
+            accept();
+        }
+    }
+
+    // The back-edge of a loop compiled with its test at the bottom
+    void loopBack(u32 label){
+        auto &sym = symTable[symId];
+        if(!sym.hasKCTV()){
+            toBranch(label, true);
+        }else{
+            sym.hitTemp();
+            if(sym.kctv){
+                flush();
+                codegen.B(cg::Label(label));
+            }
+        }
+        flush();
+    }
+
     void returnStatement(){
         if(scopeId == 0){
             setError("Can't return outside function");
@@ -2570,7 +3276,12 @@ public:
             flush();
             codegen.LDRI(cg::R0, 0);
         }else{
+            tailLocation = tok.getLocation();
+            tailCalled = false;
             expression();
+            tailLocation = ~u32{};
+            if(tailCalled)
+                return;
             symTable[symId].hitTemp();
             commitAll();
             loadToRegister(symId, 0);
@@ -2681,6 +3392,32 @@ public:
         return error;
     }
 
+    // Compact functions are compiled to bytecode when the code generator
+    // supports it, and natively otherwise.
+    void setBytecode(bool enabled){
+        if constexpr (CodeGen::hasBytecode)
+            codegen.setBytecode(enabled);
+    }
+
+    bool isBytecode(){
+        if constexpr (CodeGen::hasBytecode)
+            return codegen.isBytecode();
+        return false;
+    }
+
+    // False while compiling code that won't run where it is written
+    bool inCodeSection(){
+        return !isBytecode() && overlay == ~u32{};
+    }
+
+    u32 findOverlay(u32 hash){
+        for(u32 i=0; i<overlayCount; ++i){
+            if(overlayHashes[i] == hash)
+                return i;
+        }
+        return ~u32{};
+    }
+
     u32 initStack;
     void beginFunction(){
         using namespace cg;
@@ -2688,19 +3425,195 @@ public:
         codegen.PUSH(R4, R5, R6, R7, LR);
         codegen.NOP();
         regAlloc.clearUseMap();
+        for(auto &bits : slotPointers)
+            bits = 0;
+    }
+
+    // Functions that call nothing and leave R4-R6 alone don't need a frame
+    // saved: they return with BX LR, keeping Rt in R12 if they write it.
+    bool isLeaf(){
+        if constexpr (CodeGen::hasLinkRegister)
+            return codegen.isLeaf() && !(codegen.writtenMap() & 0x70);
+        return false;
+    }
+
+    // Only instantiated for code generators that return through LR
+    bool writesRt(){
+        if constexpr (CodeGen::hasLinkRegister)
+            return codegen.writtenMap() & 0x80;
+        return false;
+    }
+
+    void nativeMOV(cg::Reg rd, cg::Reg rm){
+        if constexpr (CodeGen::hasLinkRegister)
+            codegen.MOV(rd, rm);
+    }
+
+    void nativeBX(cg::Reg rm){
+        if constexpr (CodeGen::hasLinkRegister)
+            codegen.BX(rm);
+    }
+
+    // Scans the body ahead, weighing each use of a parameter or var by 8
+    // per enclosing loop, and gives the heaviest a register of their own
+    // in place of memory, so loops don't store and reload them each time.
+    void pinLocals(){
+        struct Candidate {
+            u32 hash, weight;
+        } candidates[maxPinCandidates];
+        u32 count = 0;
+        for(auto &sym : symTable){
+            if(sym.scopeId == scopeId && !sym.isTemp() && count < maxPinCandidates)
+                candidates[count++] = {sym.hash, 0};
+        }
+        u32 params = count;
+
+        Tokenizer::Mark resume;
+        tok.mark(resume);
+        u32 resumeToken = token;
+
+        enum Stage : u8 { Header, Start, Block, Statement };
+        struct Loop {
+            u16 braces, parens;
+            Stage stage;
+            bool isDo;
+        } loops[maxLoopNest];
+        u32 loopCount = 0, braces = 0, parens = 0, declBraces = 0, declParens = 0;
+        u32 commas[maxParenNest], args = 0;
+        bool afterDo = false, declaring = false, expectName = false;
+        do {
+            bool wasDo = afterDo, name = expectName;
+            afterDo = expectName = false;
+            if(loopCount && loops[loopCount - 1].stage == Start)
+                loops[loopCount - 1].stage = token == "{"_token ? Block : Statement;
+            switch(token){
+            case "{"_token: braces++; break;
+            case "}"_token:
+                braces--;
+                while(loopCount && loops[loopCount - 1].braces >= braces && loops[loopCount - 1].stage >= Block)
+                    afterDo = loops[--loopCount].isDo;
+                break;
+            case "("_token:
+                if(parens < maxParenNest)
+                    commas[parens] = 0;
+                parens++;
+                break;
+            case ")"_token:
+                parens--;
+                if(parens < maxParenNest && commas[parens] >= args)
+                    args = commas[parens] + 1;
+                if(loopCount && loops[loopCount - 1].stage == Header && loops[loopCount - 1].parens == parens)
+                    loops[loopCount - 1].stage = Start;
+                break;
+            case ";"_token:
+                if(braces == declBraces && parens == declParens)
+                    declaring = false;
+                while(loopCount && loops[loopCount - 1].stage == Statement &&
+                      loops[loopCount - 1].braces == braces && loops[loopCount - 1].parens == parens)
+                    afterDo = loops[--loopCount].isDo;
+                break;
+            case ","_token:
+                if(parens && parens <= maxParenNest)
+                    commas[parens - 1]++;
+                expectName = declaring && braces == declBraces && parens == declParens;
+                break;
+            case "var"_token:
+                declaring = expectName = true;
+                declBraces = braces;
+                declParens = parens;
+                break;
+            case "do"_token:
+            case "for"_token:
+            case "while"_token:
+                if(!wasDo && loopCount < maxLoopNest)
+                    loops[loopCount++] = {u16(braces), u16(parens), token == "do"_token ? Start : Header, token == "do"_token};
+                break;
+            default:
+                if(tok.getClass() != TokenClass::Word || !isName())
+                    break;
+                u32 i = 0;
+                while(i < count && candidates[i].hash != token)
+                    ++i;
+                if(name && i == count && count < maxPinCandidates)
+                    candidates[count++] = {token, 0};
+                else if(!name && i < count)
+                    candidates[i].weight += 1 << (3 * (loopCount < 3 ? loopCount : 3));
+                break;
+            }
+            accept();
+        } while(braces && tok.getClass() != TokenClass::Eof && !error);
+
+        tok.reset(resume);
+        token = resumeToken;
+
+        // Calls with more than 4 arguments pass the rest in R4-R6
+        firstHome = args > 4 ? args : 4;
+        for(u32 home = firstHome; home < 4 + maxPinned; ++home){
+            u32 best = 0;
+            for(u32 i = 1; i < count; ++i){
+                if(candidates[i].weight > candidates[best].weight)
+                    best = i;
+            }
+            if(!count || candidates[best].weight < pinWeight)
+                break;
+            candidates[best].weight = 0;
+            pinnedLocals++;
+            if(best >= params){
+                // Vars get their register once declared
+                spill(cg::RegLow(home));
+                regAlloc.pin(invalidSym, cg::RegLow(home));
+                pinHash[home - 4] = candidates[best].hash;
+                continue;
+            }
+            u32 id = createHashedSymbol(candidates[best].hash, scopeId);
+            loadToRegister(id, home);
+            regAlloc.pin(id, cg::RegLow(home));
+        }
+        pinScope = scopeId;
+    }
+
+    void pinDeclared(u32 id){
+        auto &sym = symTable[id];
+        if(sym.scopeId != pinScope)
+            return;
+        for(u32 i = 0; i < maxPinned; ++i){
+            if(pinHash[i] == sym.hash){
+                pinHash[i] = 0;
+                regAlloc.pin(id, cg::RegLow(4 + i));
+            }
+        }
+    }
+
+    void unpinLocals(){
+        for(u32 home = 4; home < 4 + maxPinned; ++home){
+            u32 id = regAlloc[cg::RegLow(home)];
+            if(regAlloc.isPinned(home) && id != invalidSym)
+                symTable[id].reg = invalidReg;
+            pinHash[home - 4] = 0;
+        }
+        pinScope = invalidSym;
+        firstHome = 4;
+        strideCount = 0;
+        regAlloc.unpin();
     }
 
     void endFunction(u32 &addr){
         using namespace cg;
         auto& writer = codegen.getWriter();
         u32 end = writer.tell();
+        bool leaf = isLeaf() && !tailLabel;
+        u32 saved = leaf ? 0 : (regAlloc.getUseMap() & 0xF0) | 0x80;
+        bool stash = leaf && writesRt();
 
         writer.seek(initStack);
 
-        if(!scopeSize)
+        u32 skip = codegen.tell();
+        for(u32 i = (leaf ? stash : 1) + (scopeSize != 0); i < 2; ++i)
             codegen.NOP();
+        skip = codegen.tell() - skip;
 
-        codegen.PUSH((regAlloc.getUseMap() & 0xF0) | 0x100 | 0x80);
+        if(!leaf) codegen.PUSH(saved | 0x100);
+        else if(stash) nativeMOV(R12, R7);
 
         if(scopeSize){
             codegen.SUB(SP, scopeSize << 2);
@@ -2708,17 +3621,40 @@ public:
             codegen.ADD(SP, scopeSize << 2);
         }else{
             writer.seek(end);
-            addr += 2;
         }
+        addr += skip;
 
-        codegen.POP((regAlloc.getUseMap() & 0xF0) | 0x100 | 0x80);
+        if(leaf){
+            if(stash) nativeMOV(R7, R12);
+            nativeBX(LR);
+        }else{
+            codegen.POP(saved | 0x100);
+        }
+        if(tailLabel){
+            codegen[cg::Label(tailLabel)];
+            if(scopeSize)
+                codegen.ADD(SP, scopeSize << 2);
+            codegen.POP(saved);
+            codegen.POP(u32{1 << 3});
+            nativeMOV(LR, R3);
+            nativeBX(R12);
+        }
         codegen.POOL();
         codegen.link();
+
+        if(stackFrame && inCodeSection()){
+            u32 count = 0;
+            for(u32 regs = saved; regs; regs &= regs - 1)
+                count++;
+            stackFrame(scopeSize, count, slotPointers);
+        }
     }
 
     void declFunction(){
         u32 location = tok.getLocation();
         u32 line = tok.getLine();
+        bool isOverlay = accept("overlay"_token);
+        bool isPlain = !isOverlay && !accept("compact"_token);
         if(!accept("function"_token) || !isName()){
             setError("Unexpected token (not function and not name)");
             return;
@@ -2735,6 +3671,14 @@ public:
         sym.init = location;
         sym.clearKCTV();
 
+        if(isOverlay && storeOverlay){
+            if(overlayCount == maxOverlays){
+                setError("Too many overlays");
+                return;
+            }
+            overlayHashes[overlayCount++] = sym.hash;
+        }
+
         if(!accept("("_token)){
             setError("declFunc: Unexpected token (not ()");
             return;
@@ -2747,7 +3691,9 @@ public:
             else accept();
         }
 
-        deadBlock();
+        u32 hash = symTable[fsymId].hash;
+        if(skipBody() && isPlain && inlineCount < maxInlines)
+            inlines[inlineCount++] = {hash, location, line};
     }
 
     void parseFunction(u32 baseAddress, u32 symId){
@@ -2761,22 +3707,40 @@ public:
         isConstexpr = true;
         scopeId = ++maxScope;
         returnLabel = nextLabel++;
+        entryLabel = nextLabel++;
+        tailLabel = 0;
+        functionSym = symId;
         scopeSize = 0;
-        functionAddress = baseAddress + codegen.tell() | 1;
         tok.setLocation(sym.init, sym.line);
+        accept();
+        overlay = findOverlay(sym.hash);
+        // only functions with a modifier start before "function"
+        setBytecode(accept("function"_token) && overlay == ~u32{});
+        functionAddress = baseAddress + codegen.tell() | CodeGen::thumbBit;
         sym.setMemInit(functionAddress);
         sym.type = Sym::FUNCTION;
+
+        u32 address = functionAddress, overlayStart = 0;
+        if(overlay != ~u32{}){
+            codegen.STUB(overlayHandler, overlay);
+            while(codegen.tell() & 3)
+                codegen.NOP(); // keeps literal pools aligned wherever the code is loaded
+            codegen.link();
+            overlayStart = codegen.tell();
+            functionAddress = baseAddress + overlayStart | CodeGen::thumbBit;
+        }
+
         beginFunction();
-        sym.kctv = functionAddress;
+        sym.kctv = address;
         clearAllKCTV();
 
-        accept(); // function
-
         // LOG((const char *)tok.getText(), "\n");
         accept(); // name
 
         declArgs();
 
+        codegen[cg::Label(entryLabel)];
+        pinLocals();
         block();
 
         if(error){
@@ -2788,6 +3752,17 @@ public:
             codegen[cg::Label(returnLabel)];
 
             endFunction(functionAddress);
+            unpinLocals();
+
+            if(overlay != ~u32{}){
+                u32 start = baseAddress + overlayStart;
+                if(!storeOverlay(overlay, start, codegen.tell() - overlayStart, functionAddress - start))
+                    setError("Could not store overlay");
+                codegen.truncate(overlayStart);
+                functionAddress = address;
+                isConstexpr = false; // its code isn't loaded while compiling
+                overlay = ~u32{};
+            }
 
             auto &sym = symTable[symId];
             sym.setMemInit(functionAddress);
@@ -2799,19 +3774,93 @@ public:
         }
     }
 
+    u32 getInlinedCalls(){
+        return inlinedCalls;
+    }
+
+    u32 getStridedArrays(){
+        return stridedArrays;
+    }
+
+    u32 getPinnedLocals(){
+        return pinnedLocals;
+    }
+
+    u32 getSpills(){
+        return spills;
+    }
+
+    u32 getReloads(){
+        return reloads;
+    }
+
+    // Name of a function parseGlobal declared, read back from its source
+    const char *functionName(u32 symId){
+        auto &sym = symTable[symId];
+        tok.setLocation(sym.init, sym.line);
+        accept();
+        accept("function"_token);
+        return tok.getText();
+    }
+
+    // Source bytes from a function's declaration to its closing brace,
+    // a rough measure of the code it would have compiled to
+    u32 functionLength(u32 symId){
+        auto &sym = symTable[symId];
+        tok.setLocation(sym.init, sym.line);
+        accept();
+        u32 depth = 0;
+        while(tok.getClass() != TokenClass::Eof){
+            if(token == "}"_token && depth == 1)
+                break;
+            if(token == "{"_token) depth++;
+            else if(token == "}"_token) depth--;
+            accept();
+        }
+        return tok.getLocation() - sym.init;
+    }
+
     u32 getGlobalScopeSize(){
         return globalScopeSize;
     }
 
+    // A "use incremental"; opening the file asks for the write barrier
+    // incremental collection needs, so only scripts using it pay for it
+    void directives(){
+        cardTable = 0;
+        if(!allocateCards || !tok.isString())
+            return;
+        Tokenizer::Mark resume;
+        tok.mark(resume);
+        u32 resumeToken = token;
+        u32 text = 5381 * 31 + '"';
+        while(tok.isString()){
+            text = text * 31 + tok.getText()[0];
+            accept();
+        }
+        if(text == hash("\"use incremental") && accept(";"_token)){
+            cardTable = allocateCards();
+            return;
+        }
+        tok.reset(resume);
+        token = resumeToken;
+    }
+
     void parseGlobal(u32 baseAddress){
+        setBytecode(false);
+        overlay = ~u32{};
         this->baseAddress = baseAddress + codegen.tell();
-        functionAddress = this->baseAddress | 1;
+        functionAddress = this->baseAddress | CodeGen::thumbBit;
+        functionSym = invalidSym;
+        tailLabel = 0;
+        inlineCount = 0;
         using namespace cg;
         beginFunction();
         scopeSize = 0;
         accept();
+        directives();
         while(tok.getClass() != TokenClass::Eof){
-            if(token == "function"_token)
+            if(token == "function"_token || token == "compact"_token || token == "overlay"_token)
                 declFunction();
             else statements();
             if(error) break;
@@ -74,6 +74,43 @@ public:
         read();
     }
 
+    // The current token and where the source continues after it, to
+    // resume from after reading elsewhere
+    struct Mark {
+        char strToken[maxStrToken];
+        TokenClass tokClass;
+        u32 numToken, strHash, line, column, location;
+        u8 next, eof, strDelim;
+    };
+
+    void mark(Mark &m){
+        for(u32 i=0; i<maxStrToken; ++i)
+            m.strToken[i] = strToken[i];
+        m.tokClass = tokClass;
+        m.numToken = numToken;
+        m.strHash = strHash;
+        m.line = line;
+        m.column = column;
+        m.location = source.tell();
+        m.next = next;
+        m.eof = eof;
+        m.strDelim = strDelim;
+    }
+
+    void reset(const Mark &m){
+        for(u32 i=0; i<maxStrToken; ++i)
+            strToken[i] = m.strToken[i];
+        tokClass = m.tokClass;
+        numToken = m.numToken;
+        strHash = m.strHash;
+        line = m.line;
+        column = m.column;
+        source.seek(m.location);
+        next = m.next;
+        eof = m.eof;
+        strDelim = m.strDelim;
+    }
+
     char *getText(){ return strToken; }
 
     u32 getLine(){ return line + 1; }
@@ -7,6 +7,8 @@ const auto reset = 0x05FA0004;
 const auto resetPtr = reinterpret_cast<volatile u32*>(0xE000ED0C);
 bool devmode = ((volatile uint32_t *) 0xE000ED00)[0] == 1947;
 
+extern "C" uint32_t us_ticker_read();
+
 #define ASM(x...) __asm__ volatile (".syntax unified\n" #x)
 void write_command_16(uint16_t data);
 void write_data_16(uint16_t data);
@@ -0,0 +1,68 @@
+// Compiles and runs a PINE script in a Linux process, so the compiler,
+// GC and runtime can be tested and timed away from the device. Needs the
+// PokittoLib desktop headers (File, LibLog, MemOps) on the include path,
+// and a non-PIE build since compiled code calls builtins by u32 address:
+//
+//   g++ -std=c++17 -no-pie -fno-pie -DPINE_HOST -I. -I<PokittoLib headers> host/pinerun.cpp -o pinerun
+//   ./pinerun script.js [frames]
+//
+// Scripts get console() and io("GC", ...)-style stats at exit; update()
+// runs once per frame, with an incremental collection step between frames.
+// PINE_HOST keeps the IDE's Desktop build from picking up a second main().
+
+#ifdef PINE_HOST
+
+#include <cstdio>
+#include <cstdlib>
+#include <sys/stat.h>
+#include "compiler/SimplePine.h"
+
+using u32 = pine::u32;
+
+static pine::ResTable resTable(32);
+
+static void console(u32 value){
+    if(auto pos = resTable.find(value)){
+        auto &file = resTable.at(pos);
+        while(auto ch = file.read<char>())
+            putchar(ch);
+    }else{
+        printf("%d", int(value));
+    }
+    putchar('\n');
+}
+
+int main(int argc, char **argv){
+    if(argc < 2){
+        printf("usage: %s script.js [frames]\n", argv[0]);
+        return 1;
+    }
+    if(!pine::mapHostMemory()){
+        printf("Could not map memory below 4GB\n");
+        return 1;
+    }
+    mkdir("pine-2k", 0755);
+    static ia::InfiniteArray<pine::Sym, 60> symTable("pine-2k/symbols.tmp");
+    pine::SimplePine pine(argv[1], resTable, symTable);
+    pine.setConstant("console", console);
+    if(!pine.compile(false)){
+        printf("%s:%u: %s\n", argv[1], pine.getLine(), pine.getError());
+        return 1;
+    }
+    pine.run();
+
+    u32 frames = argc > 2 ? atoi(argv[2]) : 0;
+    if(auto update = pine.getCall<void()>("update")){
+        for(u32 i = 0; i < frames; ++i){
+            if(pine::gcIncremental)
+                pine::gcStep(pine::gcBudget);
+            update();
+        }
+    }
+
+    pine::gcDump();
+    pine::deleteArrays();
+    return 0;
+}
+
+#endif
@@ -84,10 +84,10 @@ void run(const char *path){
     // LOG("DYNMEM: ", __allocated_memory__, "\n");
     Audio::setVolume(0);
     if(pine.compile(devmode)){
-        if( s32(0x800 - pine::globalCount * 4) > 0 ){
+        if( s32(pine::memoryMap.dataSize - pine::globalCount * 4) > 0 ){
             resTable.setCache(
-                reinterpret_cast<u32*>(0x20004000 + pine::globalCount * 4),
-                0x800 - pine::globalCount * 4
+                reinterpret_cast<u32*>(pine::memoryMap.data + pine::globalCount * 4),
+                pine::memoryMap.dataSize - pine::globalCount * 4
                 );
             fillTiles(0);
         }
@@ -99,7 +99,7 @@ void run(const char *path){
             onUpdate = pine.getCall<void()>("update");
 
         extern char   _pvHeapStart; /* Set by linker.  */
-        u32 total = (reinterpret_cast<u32>(&_pvHeapStart) - 0x10000000) +  __allocated_memory__;
+        u32 total = (reinterpret_cast<u32>(&_pvHeapStart) - pine::memoryMap.heap) +  __allocated_memory__;
         LOG("DATAMEM: ", total, " bytes (", total * 100 / (32*1024), "%) used.\n");
     } else {
         editProject(~u32{}, pine.getLine(), pine.getError());
@@ -121,7 +121,7 @@ int countDigits(uint32_t x){
 }
 
 void updateEditor(){
-    auto lineBuffer = reinterpret_cast<u16*>(0x20004000);
+    auto lineBuffer = reinterpret_cast<u16*>(pine::memoryMap.data);
     u32 firstLine = mode.firstLine;
     u32 firstColumn = 0;
     bool dirty = numPad == 0;
@@ -196,7 +196,7 @@ void editProject(u32 crashLocation, u32 errLine, const char *msg){
     onUpdate = updateEditor;
     u32 line = 0;
     u32 length = (reinterpret_cast<u32*>(mode.src)[-1] & 0xFFFF) << 2;
-    auto lineBuffer = reinterpret_cast<u16*>(0x20004000);
+    auto lineBuffer = reinterpret_cast<u16*>(pine::memoryMap.data);
     lineBuffer[0] = 0;
     for(u32 offset = 0; offset < length; ++offset){
         char c = mode.src[offset];
@@ -209,10 +209,10 @@ void editProject(u32 crashLocation, u32 errLine, const char *msg){
     for(;line < 0x400; ++line)
         lineBuffer[line] = 0;
 
-    if(crashLocation >= 0x20000000 && crashLocation < 0x20000800){
+    if(pine::memoryMap.inCode(crashLocation)){
         File a2l;
         if( a2l.openRO("pine-2k/a2l") ){
-            u32 i = (crashLocation - 0x20000000) & ~1;
+            u32 i = (crashLocation - pine::memoryMap.code) & ~1;
             errLine = 0;
             for(; s32(i) > 0; i -= 2){
                 a2l.seek(i);
@@ -236,7 +236,7 @@ void editProject(u32 crashLocation, u32 errLine, const char *msg){
 
 void updateMenu(){
     auto prevselection = selection;
-    auto projectNames = reinterpret_cast<char*>(0x20000000);
+    auto projectNames = reinterpret_cast<char*>(pine::memoryMap.code);
     bool draw = false;
     if(!mode.projectCount){
         cleanup();
@@ -434,6 +434,7 @@ void pickProject(){
 void init(bool crashed, u32 crashLocation){
     // LOG("SP: ", sizeof(ia::InfiniteArray<pine::Sym, 60>), "\n");
     PD::adjustCharStep = 0;
+    pine::gcClock = us_ticker_read;
     loadMenuColors();
     PD::invisiblecolor = 0;
     if(crashed && devmode){
@@ -446,5 +447,9 @@ void init(bool crashed, u32 crashLocation){
 void update(){
     cclass = 0;
     cmask = 0;
+    if(prefetchCount)
+        servicePrefetch(prefetchBudget);
+    if(pine::gcIncremental)
+        pine::gcStep(pine::gcBudget);
     onUpdate();
 }
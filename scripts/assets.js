@@ -10,8 +10,6 @@ const maxImages = 3000;
 let promises = [];
 let palette;
 let hashes = {};
-let acc = [];
-let imageCount = 0;
 
 function hash(str){
     str = '"' + str;
@@ -22,6 +20,14 @@ function hash(str){
     return v;
 }
 
+function pushU16(acc, v){
+    acc.push(v & 0xFF, (v >>> 8) & 0xFF);
+}
+
+function pushU32(acc, v){
+    acc.push(v & 0xFF, (v >>> 8) & 0xFF, (v >>> 16) & 0xFF, (v >>> 24) & 0xFF);
+}
+
 APP.getPalette(pal=>{
     palette = pal;
     if(pal) start();
@@ -37,30 +43,37 @@ function start(){
             .then( image => {
                 let img = convert(image, 0, 0, image.width, image.height);
                 let key = hash(file.replace(/\..*/g, ""));
-                if(hashes[key]){
-                    log("Collision: ", key, file, hashes[key]);
-                } else {
-                    // log(file, "=>", key, "@", acc.length);
-                }
-                hashes[key] = file;
-                while(acc.length&3)acc.push(0);
-                acc.push(key & 0xFF); key >>= 8;
-                acc.push(key & 0xFF); key >>= 8;
-                acc.push(key & 0xFF); key >>= 8;
-                acc.push(key & 0xFF); key >>= 8;
-                acc.push(0, 0);
-                acc.push(...img);
-                imageCount++;
-                return true;
+                return {file, key, img};
             });
-    })).then(_=>{
-        acc = [
-            (imageCount >> 0)&0xFF,
-            (imageCount >> 8)&0xFF,
-            (imageCount >> 16)&0xFF,
-            (imageCount >> 24)&0xFF,
-            ...acc
-        ];
+    })).then(entries=>{
+        let imageCount = entries.length;
+
+        // Layout: count, hashes sorted ascending, byte offset of each
+        // entry's sprite, u16 entry index of each sorted hash, sprite data.
+        // Sprites start 2 bytes past a word so their pixels are aligned.
+        let headerSize = 4 + imageCount * 10;
+        let data = [];
+        let offsets = [];
+        entries.forEach(({file, key, img}) => {
+            if(hashes[key]){
+                log("Collision: ", key, file, hashes[key]);
+            }
+            hashes[key] = file;
+            while(((headerSize + data.length) & 3) != 2)data.push(0);
+            offsets.push(headerSize + data.length);
+            data.push(...img);
+        });
+
+        let order = entries.map((e, i) => i);
+        order.sort((a, b) => (entries[a].key - entries[b].key) || (a - b));
+
+        let acc = [];
+        pushU32(acc, imageCount);
+        order.forEach(i => pushU32(acc, entries[i].key));
+        offsets.forEach(offset => pushU32(acc, offset));
+        order.forEach(i => pushU16(acc, i));
+        acc.push(...data);
+
         write("assets.bin", new Uint8Array(acc));
         write("assets.h", `
 extern "C" {